@@ -30,6 +30,7 @@ print("index = " + str(num))
 
 im = load_image("data/shu.jpg")
 res = apply_brushes(im, num)
+print_image_pool_stats()
 save_image(res, "shu")
 
 
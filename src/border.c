@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+// Map a coordinate onto [0, n) using a border policy.
+// int i: coordinate, may be outside the image.
+// int n: size of the image along that axis.
+// BORDER b: how to extend the image past its edges.
+// returns: index in [0, n), or -1 if the pixel reads as zero.
+int border_index(int i, int n, BORDER b) {
+    if (i >= 0 && i < n) return i;
+    switch (b) {
+        case BORDER_ZERO:
+            return -1;
+        case BORDER_REFLECT:
+            // fedcba|abcdef|fedcba, the edge pixel is repeated
+            i %= 2*n;
+            if (i < 0) i += 2*n;
+            return i < n ? i : 2*n - 1 - i;
+        case BORDER_WRAP:
+            i %= n;
+            return i < 0 ? i + n : i;
+        case BORDER_CLAMP:
+        default:
+            return i < 0 ? 0 : n - 1;
+    }
+}
+
+// Read a pixel, extending the image past its edges with a border policy.
+float get_pixel_border(image im, int x, int y, int c, BORDER b) {
+    x = border_index(x, im.w, b);
+    y = border_index(y, im.h, b);
+    if (x < 0 || y < 0) return 0;
+    return IMAGE_ROW(im, y, c)[x];
+}
+
+// Copy an image into a bigger one with an n pixel halo filled by a policy.
+// image im: image to pad.
+// int n: width of the halo on every side.
+// BORDER b: how to fill the halo.
+// returns: (w+2n) x (h+2n) aligned image, use image_interior to get a view
+//          of the original pixels that can be indexed n pixels past its edges.
+image pad_image(image im, int n, BORDER b) {
+    image p = make_aligned_image(im.w + 2*n, im.h + 2*n, im.c);
+    int *xs = calloc(p.w, sizeof(int));
+    for (int x = 0; x < p.w; x++) {
+        xs[x] = border_index(x - n, im.w, b);
+    }
+    for (int c = 0; c < im.c; c++) {
+        for (int y = 0; y < p.h; y++) {
+            int sy = border_index(y - n, im.h, b);
+            float *out = IMAGE_ROW(p, y, c);
+            if (sy < 0) {
+                continue;  // aligned images come back zeroed
+            }
+            float *src = IMAGE_ROW(im, sy, c);
+            for (int x = 0; x < n; x++) {
+                out[x] = xs[x] < 0 ? 0 : src[xs[x]];
+            }
+            memcpy(out + n, src, im.w * sizeof(float));
+            for (int x = n + im.w; x < p.w; x++) {
+                out[x] = xs[x] < 0 ? 0 : src[xs[x]];
+            }
+        }
+    }
+    free(xs);
+    return p;
+}
+
+// View the original pixels of an image made by pad_image.
+// The view shares memory with padded, only free padded.
+image image_interior(image padded, int n) {
+    image v = padded;
+    v.w = padded.w - 2*n;
+    v.h = padded.h - 2*n;
+    v.data = IMAGE_ROW(padded, n, 0) + n;
+    return v;
+}
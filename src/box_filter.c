@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+// Box filters as running sums. Each output row keeps one sum per column of
+// the s input rows around it, adding the row entering the window and
+// subtracting the row leaving it, then slides an s wide window along that
+// row of column sums. Cost per pixel doesn't depend on s and no integral
+// image is built. u8 images are summed in ints, so their sums are exact;
+// other formats are summed in doubles, which don't drift over a frame the
+// way float prefix sums do.
+
+// Add (sign 1) or subtract (sign -1) row k of channel c into the column
+// sums, icol for u8 images and dcol for the rest. row is scratch.
+static void add_row(image im, int c, int k, int sign, BORDER border, int *icol, double *dcol, float *row)
+{
+    int y = border_index(k, im.h, border);
+    int x;
+    if(y < 0) return;
+    if(icol){
+        const unsigned char *p = IMAGE_ROW8(im, y, c);
+        if(sign > 0) for(x = 0; x < im.w; ++x) icol[x] += p[x];
+        else for(x = 0; x < im.w; ++x) icol[x] -= p[x];
+        return;
+    }
+    const float *p = row;
+    if(im.format == IMAGE_F32) p = IMAGE_ROW(im, y, c);
+    else row_to_float(im, y, c, row);
+    if(sign > 0) for(x = 0; x < im.w; ++x) dcol[x] += p[x];
+    else for(x = 0; x < im.w; ++x) dcol[x] -= p[x];
+}
+
+// Sum of the s x s window around every pixel of channel c of im, window
+// [x - s/2, x - s/2 + s) on both axes, read past the edges with border.
+// Writes sums*scale (mean: u8 output rounded from the exact integer sum)
+// into channel oc of out. Threads take bands of rows, each band starts its
+// column sums from scratch.
+static void box_plane(image im, int c, int s, BORDER border, int mean, image out, int oc)
+{
+    int w = im.w, h = im.h;
+    int lo = s/2, hi = s - 1 - s/2;
+    int integer = im.format == IMAGE_U8;
+    double scale = mean ? 1./((double)s*s) : 1;
+    if(integer && !mean) scale = 1/255.;
+    int threads = get_image_threads();
+    int band = MAX(16, (h + 4*threads - 1)/(4*threads));
+    int y0;
+    #pragma omp parallel num_threads(threads)
+    {
+        int *icol = integer ? calloc(w, sizeof(int)) : 0;
+        int *ipad = integer ? calloc(w + s, sizeof(int)) : 0;
+        double *dcol = integer ? 0 : calloc(w, sizeof(double));
+        double *dpad = integer ? 0 : calloc(w + s, sizeof(double));
+        float *row = calloc(w, sizeof(float));
+        int *xs = calloc(w + s, sizeof(int));
+        int i, x, y, k;
+        for(i = 0; i < w + s - 1; ++i) xs[i] = border_index(i - lo, w, border);
+
+        #pragma omp for schedule(dynamic)
+        for(y0 = 0; y0 < h; y0 += band){
+            if(integer) memset(icol, 0, w*sizeof(int));
+            else memset(dcol, 0, w*sizeof(double));
+            for(y = y0; y < MIN(y0 + band, h); ++y){
+                if(y == y0){
+                    for(k = y - lo; k <= y + hi; ++k) add_row(im, c, k, 1, border, icol, dcol, row);
+                } else {
+                    add_row(im, c, y + hi, 1, border, icol, dcol, row);
+                    add_row(im, c, y - lo - 1, -1, border, icol, dcol, row);
+                }
+
+                float *o = out.format == IMAGE_F32 ? IMAGE_ROW(out, y, oc) : row;
+                if(integer){
+                    int sum = 0;
+                    for(i = 0; i < w + s - 1; ++i) ipad[i] = xs[i] < 0 ? 0 : icol[xs[i]];
+                    for(i = 0; i < s; ++i) sum += ipad[i];
+                    if(mean && out.format == IMAGE_U8){
+                        unsigned char *b = IMAGE_ROW8(out, y, oc);
+                        int n = s*s;
+                        for(x = 0; x < w; ++x){
+                            b[x] = (sum + n/2)/n;
+                            sum += ipad[x + s] - ipad[x];
+                        }
+                        continue;
+                    }
+                    for(x = 0; x < w; ++x){
+                        o[x] = sum*scale;
+                        sum += ipad[x + s] - ipad[x];
+                    }
+                } else {
+                    double sum = 0;
+                    for(i = 0; i < w + s - 1; ++i) dpad[i] = xs[i] < 0 ? 0 : dcol[xs[i]];
+                    for(i = 0; i < s; ++i) sum += dpad[i];
+                    for(x = 0; x < w; ++x){
+                        o[x] = sum*scale;
+                        sum += dpad[x + s] - dpad[x];
+                    }
+                }
+                if(o == row) float_to_row(out, y, oc, row);
+            }
+        }
+        free(icol);
+        free(ipad);
+        free(dcol);
+        free(dpad);
+        free(row);
+        free(xs);
+    }
+}
+
+// Sum of the s x s window around every pixel.
+// image im: image to filter, any format.
+// int s: window size, even sizes reach one pixel further left and up.
+// BORDER border: how to read past the edges, BORDER_ZERO sums only the
+//                pixels inside the image.
+// returns: float image of window sums.
+image box_sum_image(image im, int s, BORDER border)
+{
+    image out = make_image(im.w, im.h, im.c);
+    int c;
+    for(c = 0; c < im.c; ++c) box_plane(im, c, s, border, 0, out, c);
+    return out;
+}
+
+// Mean of the s x s window around every pixel, same as convolving with
+// make_box_filter(s). returns: image in the same format as im.
+image box_blur_image(image im, int s, BORDER border)
+{
+    image out = make_image_like(im, im.w, im.h, im.c);
+    int c;
+    for(c = 0; c < im.c; ++c) box_plane(im, c, s, border, 1, out, c);
+    return out;
+}
+
+// Gaussian blur approximated by passes box blurs, after Kovesi, "Fast
+// almost-Gaussian filtering" (2010). Box widths are the two odd sizes
+// around the ideal one, mixed so the variances add up to sigma^2.
+// 3 passes are within a few percent of a Gaussian, more get closer.
+// image im: image to smooth, any format.
+// returns: smoothed image in the same format, borders clamped.
+image smooth_image_box(image im, float sigma, int passes)
+{
+    if(passes < 1) passes = 1;
+    double v = 12.*sigma*sigma;
+    int wl = floor(sqrt(v/passes + 1));
+    if(wl % 2 == 0) --wl;
+    int m = round((v - passes*wl*wl - 4.*passes*wl - 3.*passes)/(-4.*wl - 4));
+    image cur = im.format == IMAGE_F32 ? im : convert_image(im, IMAGE_F32);
+    int i;
+    for(i = 0; i < passes; ++i){
+        image next = box_blur_image(cur, i < m ? wl : wl + 2, BORDER_CLAMP);
+        if(cur.data != im.data) free_image(cur);
+        cur = next;
+    }
+    if(im.format != IMAGE_F32){
+        image n = convert_image(cur, im.format);
+        free_image(cur);
+        return n;
+    }
+    return cur;
+}
@@ -17,7 +17,7 @@ data random_batch(data d, int n)
     y.data = calloc(n, sizeof(double*));
     int i;
     for(i = 0; i < n; ++i){
-        int ind = rand()%d.X.rows;
+        int ind = thread_rand()%d.X.rows;
         X.data[i] = d.X.data[ind];
         y.data[i] = d.y.data[ind];
     }
@@ -43,44 +43,53 @@ list *get_lines(char *filename)
     return lines;
 }
 
+typedef struct{
+    char **paths, **labels;
+    int k, bias, cols;
+    matrix X, y;
+} classification_load;
+
+// Copy image i into row i of X and mark its labels in y.
+static void add_example(int i, image im, void *ctx)
+{
+    classification_load *l = ctx;
+    int j;
+    if (!l->cols) {
+        l->cols = im.w*im.h*im.c;
+        l->X = make_matrix(l->y.rows, l->cols + (l->bias != 0));
+    }
+    for (j = 0; j < l->cols; ++j){
+        l->X.data[i][j] = im.data[j];
+    }
+    if(l->bias) l->X.data[i][l->cols] = 1;
+
+    for (j = 0; j < l->k; ++j){
+        if(strstr(l->paths[i], l->labels[j])){
+            l->y.data[i][j] = 1;
+        }
+    }
+    free_image(im);
+}
+
 data load_classification_data(char *images, char *label_file, int bias)
 {
     list *image_list = get_lines(images);
     list *label_list = get_lines(label_file);
-    int k = label_list->size;
-    char **labels = (char **)list_to_array(label_list);
+    classification_load l = {0};
+    l.k = label_list->size;
+    l.labels = (char **)list_to_array(label_list);
+    l.paths = (char **)list_to_array(image_list);
+    l.bias = bias;
+    l.y = make_matrix(image_list->size, l.k);
 
-    int n = image_list->size;
-    node *nd = image_list->front;
-    int cols = 0;
-    int i;
-    int count = 0;
-    matrix X;
-    matrix y = make_matrix(n, k);
-    while(nd){
-        char *path = (char *)nd->val;
-        image im = load_image(path);
-        if (!cols) {
-            cols = im.w*im.h*im.c;
-            X = make_matrix(n, cols + (bias != 0));
-        }
-        for (i = 0; i < cols; ++i){
-            X.data[count][i] = im.data[i];
-        }
-        if(bias) X.data[count][cols] = 1;
+    // images decode in parallel and land in X in file order
+    load_images_each(l.paths, image_list->size, add_example, &l);
 
-        for (i = 0; i < k; ++i){
-            if(strstr(path, labels[i])){
-                y.data[count][i] = 1;
-            }
-        }
-        ++count;
-        nd = nd->next;
-    }
+    free(l.paths);
     free_list(image_list);
     data d;
-    d.X = X;
-    d.y = y;
+    d.X = l.X;
+    d.y = l.y;
     return d;
 }
 
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+
+// Shrinking by a whole factor f with every output pixel the mean of its
+// f x f block. No coordinates are computed: each output row sums its f
+// input rows column by column, then sums every f columns of that, with
+// the column step unrolled for the usual factors. RGB can be folded to
+// gray while the rows are summed, so a color frame is read once.
+// u8 images are summed in ints and rounded once at the end.
+
+// Sum every f entries of a into o, n outputs.
+#define DECIMATE_ROW(T, a, o, n, f) do { \
+    int x_, k_; \
+    if((f) == 2) for(x_ = 0; x_ < (n); ++x_) (o)[x_] = (a)[2*x_] + (a)[2*x_+1]; \
+    else if((f) == 3) for(x_ = 0; x_ < (n); ++x_) (o)[x_] = (a)[3*x_] + (a)[3*x_+1] + (a)[3*x_+2]; \
+    else if((f) == 4) for(x_ = 0; x_ < (n); ++x_) \
+        (o)[x_] = ((a)[4*x_] + (a)[4*x_+1]) + ((a)[4*x_+2] + (a)[4*x_+3]); \
+    else for(x_ = 0; x_ < (n); ++x_){ \
+        T s_ = 0; \
+        for(k_ = 0; k_ < (f); ++k_) s_ += (a)[(f)*x_ + k_]; \
+        (o)[x_] = s_; \
+    } \
+} while(0)
+
+// Gray weights, the u8 ones sum to 256 like rgb_to_grayscale's
+static const int GRAY8[3] = {77, 150, 29};
+static const float GRAYF[3] = {0.299f, 0.587f, 0.114f};
+
+static void downscale_u8(image im, int f, int gray, image out)
+{
+    int n = out.w*f;
+    int y;
+    int div = f*f*(gray ? 256 : 1);
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        int *acc = calloc(n, sizeof(int));
+        int *sum = calloc(out.w, sizeof(int));
+        int c, k, x;
+        #pragma omp for schedule(static)
+        for(y = 0; y < out.h; ++y){
+            for(c = 0; c < out.c; ++c){
+                memset(acc, 0, n*sizeof(int));
+                for(k = 0; k < f; ++k){
+                    int sy = y*f + k;
+                    if(gray){
+                        const unsigned char *r = IMAGE_ROW8(im, sy, 0);
+                        const unsigned char *g = IMAGE_ROW8(im, sy, 1);
+                        const unsigned char *b = IMAGE_ROW8(im, sy, 2);
+                        for(x = 0; x < n; ++x) acc[x] += GRAY8[0]*r[x] + GRAY8[1]*g[x] + GRAY8[2]*b[x];
+                    } else {
+                        const unsigned char *p = IMAGE_ROW8(im, sy, c);
+                        for(x = 0; x < n; ++x) acc[x] += p[x];
+                    }
+                }
+                DECIMATE_ROW(int, acc, sum, out.w, f);
+                unsigned char *o = IMAGE_ROW8(out, y, c);
+                for(x = 0; x < out.w; ++x) o[x] = (sum[x] + div/2)/div;
+            }
+        }
+        free(acc);
+        free(sum);
+    }
+}
+
+static void downscale_float(image im, int f, int gray, image out)
+{
+    int n = out.w*f;
+    int y;
+    float scale = 1.f/(f*f);
+    int narrow = im.format != IMAGE_F32;
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *acc = calloc(n, sizeof(float));
+        float *sum = calloc(out.w, sizeof(float));
+        float *row = narrow ? calloc(3*im.w, sizeof(float)) : 0;
+        int c, k, x, j;
+        #pragma omp for schedule(static)
+        for(y = 0; y < out.h; ++y){
+            for(c = 0; c < out.c; ++c){
+                memset(acc, 0, n*sizeof(float));
+                for(k = 0; k < f; ++k){
+                    int sy = y*f + k;
+                    for(j = gray ? 0 : c; j < (gray ? 3 : c + 1); ++j){
+                        const float *p = row + j*im.w;
+                        if(narrow) row_to_float(im, sy, j, row + j*im.w);
+                        else p = IMAGE_ROW(im, sy, j);
+                        float wt = gray ? GRAYF[j] : 1;
+                        for(x = 0; x < n; ++x) acc[x] += wt*p[x];
+                    }
+                }
+                float *o = out.format == IMAGE_F32 ? IMAGE_ROW(out, y, c) : row;
+                DECIMATE_ROW(float, acc, sum, out.w, f);
+                for(x = 0; x < out.w; ++x) o[x] = sum[x]*scale;
+                if(narrow) float_to_row(out, y, c, o);
+            }
+        }
+        free(acc);
+        free(sum);
+        free(row);
+    }
+}
+
+// Shrink an image by a whole factor, averaging each f x f block. Pixels
+// past the last whole block on the right and bottom are dropped, like
+// nn_resize(im, im.w/f, im.h/f).
+// int f: factor, >= 1.
+// int gray: fold a 3 channel image to one gray channel on the way.
+// returns: im.w/f x im.h/f image in the same format as im.
+image downscale_image(image im, int f, int gray)
+{
+    assert(f >= 1);
+    assert(!gray || im.c == 3);
+    image out = make_image_like(im, im.w/f, im.h/f, gray ? 1 : im.c);
+    if(out.w == 0 || out.h == 0) return out;
+    if(im.format == IMAGE_U8) downscale_u8(im, f, gray, out);
+    else downscale_float(im, f, gray, out);
+    return out;
+}
@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <assert.h>
+#include "image.h"
+
+// Convolution through the FFT, for big filters that don't separate.
+// The image is cut into tiles and each tile is filtered by overlap-save:
+// a tile of Nx x Ny input pixels (the output block plus the filter's
+// halo) is transformed, multiplied by the filter's spectrum and
+// transformed back, and the block of outputs that didn't wrap around is
+// kept. Halo pixels come from border_index, so every border policy works.
+// The FFT is a mixed radix Stockham transform for sizes made of 2, 3 and 5.
+// Real rows go through it two at a time packed as one complex row, and only
+// the Nx/2+1 non-negative frequencies of each row are kept.
+
+typedef struct{
+    float re, im;
+} cpx;
+
+// Transform of one length, n = product of the radices in factors.
+typedef struct{
+    int n, nf;
+    int factors[32];
+    cpx *w;  // w[j] = exp(-2 pi i j / n)
+} fft_plan;
+
+static fft_plan make_fft_plan(int n)
+{
+    assert(n >= 2);
+    fft_plan p = {0};
+    p.n = n;
+    int m = n;
+    while(m % 4 == 0){ p.factors[p.nf++] = 4; m /= 4; }
+    while(m % 2 == 0){ p.factors[p.nf++] = 2; m /= 2; }
+    while(m % 3 == 0){ p.factors[p.nf++] = 3; m /= 3; }
+    while(m % 5 == 0){ p.factors[p.nf++] = 5; m /= 5; }
+    int f;
+    for(f = 7; m > 1; ++f){
+        while(m % f == 0){ p.factors[p.nf++] = f; m /= f; }
+    }
+    p.w = calloc(n, sizeof(cpx));
+    int j;
+    for(j = 0; j < n; ++j){
+        p.w[j].re = cos(TWOPI*j/n);
+        p.w[j].im = -sin(TWOPI*j/n);
+    }
+    return p;
+}
+
+static void free_fft_plan(fft_plan p)
+{
+    free(p.w);
+}
+
+static inline cpx cmul(cpx a, cpx b)
+{
+    cpx c = {a.re*b.re - a.im*b.im, a.re*b.im + a.im*b.re};
+    return c;
+}
+
+// Forward transform of x in place, t is scratch of the same length.
+// Each stage with radix r splits the current length l into r interleaved
+// sequences of stride s, so the output lands in natural order without a
+// bit reversal pass.
+static void fft(const fft_plan *p, cpx *x, cpx *t)
+{
+    int n = p->n;
+    int s = 1, l = n, f, k, q, j, u;
+    cpx *in = x, *out = t;
+    for(f = 0; f < p->nf; ++f){
+        int r = p->factors[f];
+        int m = l/r;
+        for(k = 0; k < m; ++k){
+            for(q = 0; q < s; ++q){
+                cpx a[32], b[32];
+                for(j = 0; j < r; ++j) a[j] = in[q + s*(k + j*m)];
+                if(r == 2){
+                    b[0].re = a[0].re + a[1].re; b[0].im = a[0].im + a[1].im;
+                    b[1].re = a[0].re - a[1].re; b[1].im = a[0].im - a[1].im;
+                } else if(r == 4){
+                    cpx s0 = {a[0].re + a[2].re, a[0].im + a[2].im};
+                    cpx d0 = {a[0].re - a[2].re, a[0].im - a[2].im};
+                    cpx s1 = {a[1].re + a[3].re, a[1].im + a[3].im};
+                    cpx d1 = {a[1].re - a[3].re, a[1].im - a[3].im};
+                    b[0].re = s0.re + s1.re; b[0].im = s0.im + s1.im;
+                    b[2].re = s0.re - s1.re; b[2].im = s0.im - s1.im;
+                    b[1].re = d0.re + d1.im; b[1].im = d0.im - d1.re;
+                    b[3].re = d0.re - d1.im; b[3].im = d0.im + d1.re;
+                } else {
+                    // plain DFT, radices past 4 are rare and short
+                    for(u = 0; u < r; ++u){
+                        cpx sum = {0, 0};
+                        for(j = 0; j < r; ++j){
+                            cpx e = cmul(a[j], p->w[(j*u % r)*(n/r)]);
+                            sum.re += e.re;
+                            sum.im += e.im;
+                        }
+                        b[u] = sum;
+                    }
+                }
+                out[q + s*(r*k)] = b[0];
+                for(u = 1; u < r; ++u){
+                    out[q + s*(r*k + u)] = cmul(b[u], p->w[k*u*s]);
+                }
+            }
+        }
+        cpx *swap = in; in = out; out = swap;
+        s *= r;
+        l = m;
+    }
+    if(in != x) memcpy(x, in, n*sizeof(cpx));
+}
+
+// Inverse transform without the 1/n, through conj(fft(conj(x))).
+static void ifft(const fft_plan *p, cpx *x, cpx *t)
+{
+    int i;
+    for(i = 0; i < p->n; ++i) x[i].im = -x[i].im;
+    fft(p, x, t);
+    for(i = 0; i < p->n; ++i) x[i].im = -x[i].im;
+}
+
+// Transform sizes the tiles use: even products of 2, 3 and 5.
+static int is_fft_size(int n)
+{
+    if(n % 2) return 0;
+    while(n % 2 == 0) n /= 2;
+    while(n % 3 == 0) n /= 3;
+    while(n % 5 == 0) n /= 5;
+    return n == 1;
+}
+
+static int next_fft_size(int n)
+{
+    while(!is_fft_size(n)) ++n;
+    return n;
+}
+
+// Largest tile side, keeps a tile's spectrum in L2 and caches small.
+#define FFT_MAX_TILE 512
+
+// Plans and scratch for an Nx x Ny tile. Spectra are stored transposed,
+// hx = Nx/2+1 rows of Ny frequencies, so both passes run on contiguous rows.
+typedef struct{
+    int nx, ny, hx;
+    fft_plan px, py;
+    float *real;  // ny x nx tile of pixels
+    cpx *row;     // nx, packed pair of rows
+    cpx *col;     // max(nx, ny) scratch
+} fft_tile;
+
+static fft_tile make_fft_tile(int nx, int ny)
+{
+    fft_tile t;
+    t.nx = nx;
+    t.ny = ny;
+    t.hx = nx/2 + 1;
+    t.px = make_fft_plan(nx);
+    t.py = make_fft_plan(ny);
+    t.real = calloc((size_t)nx*ny, sizeof(float));
+    t.row = calloc(nx, sizeof(cpx));
+    t.col = calloc(MAX(nx, ny), sizeof(cpx));
+    return t;
+}
+
+static void free_fft_tile(fft_tile t)
+{
+    free_fft_plan(t.px);
+    free_fft_plan(t.py);
+    free(t.real);
+    free(t.row);
+    free(t.col);
+}
+
+// 2d transform of t->real into spec (hx x ny, transposed).
+static void tile_forward(fft_tile *t, cpx *spec)
+{
+    int nx = t->nx, ny = t->ny, hx = t->hx;
+    int x, y, k;
+    for(y = 0; y < ny; y += 2){
+        const float *a = t->real + (size_t)y*nx;
+        const float *b = a + nx;
+        for(x = 0; x < nx; ++x){
+            t->row[x].re = a[x];
+            t->row[x].im = b[x];
+        }
+        fft(&t->px, t->row, t->col);
+        // Z = A + iB with A, B real, so A = (Z[k] + Z*[-k])/2, B = (Z[k] - Z*[-k])/2i
+        for(k = 0; k < hx; ++k){
+            cpx z = t->row[k];
+            cpx zc = t->row[(nx - k) % nx];
+            cpx *s = spec + (size_t)k*ny + y;
+            s[0].re = .5f*(z.re + zc.re);
+            s[0].im = .5f*(z.im - zc.im);
+            s[1].re = .5f*(z.im + zc.im);
+            s[1].im = .5f*(zc.re - z.re);
+        }
+    }
+    for(k = 0; k < hx; ++k){
+        fft(&t->py, spec + (size_t)k*ny, t->col);
+    }
+}
+
+// 2d inverse of spec into the first rows of t->real, unscaled.
+// spec is overwritten.
+static void tile_inverse(fft_tile *t, cpx *spec, int rows)
+{
+    int nx = t->nx, ny = t->ny, hx = t->hx;
+    int x, y, k;
+    for(k = 0; k < hx; ++k){
+        ifft(&t->py, spec + (size_t)k*ny, t->col);
+    }
+    for(y = 0; y < rows; y += 2){
+        // rebuild Z = A + iB from the half spectra of rows y and y+1
+        for(k = 0; k < hx; ++k){
+            cpx a = spec[(size_t)k*ny + y];
+            cpx b = spec[(size_t)k*ny + y + 1];
+            t->row[k].re = a.re - b.im;
+            t->row[k].im = a.im + b.re;
+            if(k > 0 && k < nx - k){
+                t->row[nx - k].re = a.re + b.im;
+                t->row[nx - k].im = b.re - a.im;
+            }
+        }
+        ifft(&t->px, t->row, t->col);
+        float *a = t->real + (size_t)y*nx;
+        float *b = a + nx;
+        for(x = 0; x < nx; ++x){
+            a[x] = t->row[x].re;
+            b[x] = t->row[x].im;
+        }
+    }
+}
+
+// Spectra of recently used filters, keyed by their taps and tile size.
+// Each entry holds conj(F(filter))/(nx*ny) per filter channel, so a tile is
+// correlated with the filter, like convolve_image does, by one multiply.
+#define FFT_CACHE 8
+
+typedef struct{
+    int w, h, c, nx, ny;
+    float *taps;
+    cpx *spec;
+    size_t used;
+} fft_cache_entry;
+
+static fft_cache_entry fft_cache[FFT_CACHE];
+static size_t fft_cache_clock;
+static pthread_mutex_t fft_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void copy_taps(image filter, float *taps)
+{
+    int y, c;
+    for(c = 0; c < filter.c; ++c){
+        for(y = 0; y < filter.h; ++y){
+            memcpy(taps + ((size_t)c*filter.h + y)*filter.w, IMAGE_ROW(filter, y, c), filter.w*sizeof(float));
+        }
+    }
+}
+
+static cpx *make_filter_spectrum(image filter, fft_tile *t)
+{
+    size_t n = (size_t)t->hx*t->ny;
+    cpx *spec = calloc(n*filter.c, sizeof(cpx));
+    float scale = 1.f/((float)t->nx*t->ny);
+    int x, y, c;
+    size_t i;
+    for(c = 0; c < filter.c; ++c){
+        memset(t->real, 0, (size_t)t->nx*t->ny*sizeof(float));
+        for(y = 0; y < filter.h; ++y){
+            for(x = 0; x < filter.w; ++x){
+                t->real[(size_t)y*t->nx + x] = get_pixel(filter, x, y, c);
+            }
+        }
+        cpx *s = spec + n*c;
+        tile_forward(t, s);
+        for(i = 0; i < n; ++i){
+            s[i].re *= scale;
+            s[i].im *= -scale;
+        }
+    }
+    return spec;
+}
+
+// Spectrum of a filter for a tile size, from the cache or computed and
+// cached. returns: a copy the caller frees, so eviction can't pull it away.
+static cpx *filter_spectrum(image filter, fft_tile *t)
+{
+    size_t ntaps = (size_t)filter.w*filter.h*filter.c;
+    float *taps = calloc(ntaps, sizeof(float));
+    copy_taps(filter, taps);
+    int i;
+    pthread_mutex_lock(&fft_cache_lock);
+    for(i = 0; i < FFT_CACHE; ++i){
+        fft_cache_entry *e = &fft_cache[i];
+        if(e->spec && e->w == filter.w && e->h == filter.h && e->c == filter.c
+                && e->nx == t->nx && e->ny == t->ny
+                && !memcmp(e->taps, taps, ntaps*sizeof(float))){
+            size_t bytes = (size_t)t->hx*t->ny*filter.c*sizeof(cpx);
+            cpx *spec = malloc(bytes);
+            memcpy(spec, e->spec, bytes);
+            e->used = ++fft_cache_clock;
+            pthread_mutex_unlock(&fft_cache_lock);
+            free(taps);
+            return spec;
+        }
+    }
+    pthread_mutex_unlock(&fft_cache_lock);
+
+    cpx *spec = make_filter_spectrum(filter, t);
+    size_t bytes = (size_t)t->hx*t->ny*filter.c*sizeof(cpx);
+    cpx *keep = malloc(bytes);
+    memcpy(keep, spec, bytes);
+
+    pthread_mutex_lock(&fft_cache_lock);
+    fft_cache_entry *old = &fft_cache[0];
+    for(i = 1; i < FFT_CACHE; ++i){
+        if(fft_cache[i].used < old->used) old = &fft_cache[i];
+    }
+    free(old->taps);
+    free(old->spec);
+    old->w = filter.w;
+    old->h = filter.h;
+    old->c = filter.c;
+    old->nx = t->nx;
+    old->ny = t->ny;
+    old->taps = taps;
+    old->spec = keep;
+    old->used = ++fft_cache_clock;
+    pthread_mutex_unlock(&fft_cache_lock);
+    return spec;
+}
+
+// Drop every cached filter spectrum.
+void clear_fft_cache()
+{
+    int i;
+    pthread_mutex_lock(&fft_cache_lock);
+    for(i = 0; i < FFT_CACHE; ++i){
+        free(fft_cache[i].taps);
+        free(fft_cache[i].spec);
+    }
+    memset(fft_cache, 0, sizeof(fft_cache));
+    pthread_mutex_unlock(&fft_cache_lock);
+}
+
+// Relative cost of the two paths, in multiply-adds of the direct loop.
+// A tile costs one forward transform per input channel and one inverse per
+// output channel, each about nx*ny/2 * log2(nx*ny) butterflies at roughly
+// FFT_BUTTERFLY multiply-adds (direct taps vectorize, butterflies shuffle),
+// and the edge tiles are paid for in full.
+#define FFT_BUTTERFLY 16
+
+static double tile_cost(int w, int h, int kw, int kh, int c, int oc, int nx, int ny)
+{
+    double tiles = (double)((w + nx - kw) / (nx - kw + 1)) * ((h + ny - kh) / (ny - kh + 1));
+    double n = (double)nx*ny;
+    return tiles*(c + oc)*(FFT_BUTTERFLY*.5*n*log2(n) + n);
+}
+
+// Pick the cheapest tile size for a filter, writes it to nx and ny. A
+// tile always holds at least one output past the filter, even when the
+// image is thinner than that.
+// returns: estimated cost of the FFT path, < 0 if no tile fits.
+static double choose_fft_tile(int w, int h, int kw, int kh, int c, int oc, int *nx, int *ny)
+{
+    double best = -1;
+    int bx = 0, by = 0, x, y;
+    int mx = MIN(next_fft_size(w + kw - 1), MAX(FFT_MAX_TILE, next_fft_size(2*kw)));
+    int my = MIN(next_fft_size(h + kh - 1), MAX(FFT_MAX_TILE, next_fft_size(2*kh)));
+    mx = MAX(mx, next_fft_size(kw + 1));
+    my = MAX(my, next_fft_size(kh + 1));
+    for(y = next_fft_size(kh + 1); y <= my; y = next_fft_size(y + 1)){
+        for(x = next_fft_size(kw + 1); x <= mx; x = next_fft_size(x + 1)){
+            double cost = tile_cost(w, h, kw, kh, c, oc, x, y);
+            if(best < 0 || cost < best){
+                best = cost;
+                bx = x;
+                by = y;
+            }
+        }
+    }
+    *nx = bx;
+    *ny = by;
+    return best;
+}
+
+// Whether convolve_image should take the FFT path for a filter.
+int use_fft_convolve(image im, image filter, int preserve)
+{
+    int nx, ny;
+    if(filter.w*filter.h < 64) return 0;
+    double direct = (double)im.w*im.h*im.c*filter.w*filter.h;
+    double fft = choose_fft_tile(im.w, im.h, filter.w, filter.h, im.c, preserve ? im.c : 1, &nx, &ny);
+    return fft >= 0 && fft < direct;
+}
+
+// Load the input for the tile whose outputs start at (x0, y0) into t->real.
+// Pixel (i, j) of the tile is image pixel (x0 - rx + i, y0 - ry + j).
+static void load_tile(fft_tile *t, image im, int c, int x0, int y0, int cols, int rows, int rx, int ry, BORDER border)
+{
+    int i, j;
+    memset(t->real, 0, (size_t)t->nx*t->ny*sizeof(float));
+    // columns [i0, i1) of the tile lie inside the image
+    int i0 = MIN(MAX(rx - x0, 0), cols);
+    int i1 = MAX(MIN(im.w - x0 + rx, cols), i0);
+    for(j = 0; j < rows; ++j){
+        int sy = border_index(y0 - ry + j, im.h, border);
+        if(sy < 0) continue;
+        const float *src = IMAGE_ROW(im, sy, c);
+        float *dst = t->real + (size_t)j*t->nx;
+        for(i = 0; i < i0; ++i){
+            int sx = border_index(x0 - rx + i, im.w, border);
+            if(sx >= 0) dst[i] = src[sx];
+        }
+        memcpy(dst + i0, src + x0 - rx + i0, (i1 - i0)*sizeof(float));
+        for(i = i1; i < cols; ++i){
+            int sx = border_index(x0 - rx + i, im.w, border);
+            if(sx >= 0) dst[i] = src[sx];
+        }
+    }
+}
+
+image convolve_fft(image im, image filter, int preserve)
+{
+    return convolve_fft_border(im, filter, preserve, BORDER_CLAMP);
+}
+
+// Convolve an image through the FFT. Same results as convolve_image_border
+// up to float rounding, at a cost that barely depends on the filter size.
+image convolve_fft_border(image im, image filter, int preserve, BORDER border)
+{
+    int narrow = im.format != IMAGE_F32;
+    image src = narrow ? convert_image(im, IMAGE_F32) : im;
+    int oc = preserve ? im.c : 1;
+    image out = narrow ? make_image(im.w, im.h, oc) : make_image_like(im, im.w, im.h, oc);
+
+    int nx, ny;
+    choose_fft_tile(im.w, im.h, filter.w, filter.h, im.c, oc, &nx, &ny);
+    fft_tile ft = make_fft_tile(nx, ny);
+    cpx *fspec = filter_spectrum(filter, &ft);
+    free_fft_tile(ft);
+    size_t n = (size_t)ft.hx*ny;
+
+    int rx = filter.w/2, ry = filter.h/2;
+    int bw = nx - filter.w + 1, bh = ny - filter.h + 1;
+    int tx = (im.w + bw - 1)/bw;
+    int ntiles = tx*((im.h + bh - 1)/bh);
+    int k;
+    // Tiles write disjoint blocks of out, threads take them one at a time.
+    // Channels are summed per tile in order, so preserve = 0 gives the same
+    // result whatever the thread count.
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        fft_tile t = make_fft_tile(nx, ny);
+        cpx *spec = calloc(n, sizeof(cpx));
+        cpx *sum = calloc(n, sizeof(cpx));
+        int c, y;
+        size_t i;
+        #pragma omp for schedule(dynamic)
+        for(k = 0; k < ntiles; ++k){
+            int x0 = k%tx*bw, y0 = k/tx*bh;
+            int rows = MIN(bh, im.h - y0);
+            int cols = MIN(bw, im.w - x0);
+            if(!preserve) memset(sum, 0, n*sizeof(cpx));
+            for(c = 0; c < im.c; ++c){
+                load_tile(&t, src, c, x0, y0, cols + filter.w - 1, rows + filter.h - 1, rx, ry, border);
+                tile_forward(&t, spec);
+                const cpx *f = fspec + (filter.c == 1 ? 0 : n*c);
+                cpx *acc = preserve ? spec : sum;
+                for(i = 0; i < n; ++i){
+                    cpx p = cmul(spec[i], f[i]);
+                    if(preserve){
+                        acc[i] = p;
+                    } else {
+                        acc[i].re += p.re;
+                        acc[i].im += p.im;
+                    }
+                }
+                if(!preserve) continue;
+                tile_inverse(&t, spec, rows);
+                for(y = 0; y < rows; ++y){
+                    memcpy(IMAGE_ROW(out, y0 + y, c) + x0, t.real + (size_t)y*nx, cols*sizeof(float));
+                }
+            }
+            if(preserve) continue;
+            tile_inverse(&t, sum, rows);
+            for(y = 0; y < rows; ++y){
+                memcpy(IMAGE_ROW(out, y0 + y, 0) + x0, t.real + (size_t)y*nx, cols*sizeof(float));
+            }
+        }
+        free(spec);
+        free(sum);
+        free_fft_tile(t);
+    }
+
+    free(fspec);
+    if(narrow) free_image(src);
+    if(preserve && narrow){
+        image ret = convert_image(out, im.format);
+        free_image(out);
+        return ret;
+    }
+    return out;
+}
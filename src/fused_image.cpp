@@ -0,0 +1,49 @@
+#include "image.hpp"
+
+using namespace uwimg;
+
+extern "C" {
+
+// Make a hybrid image in one pass: the low frequencies of one image plus
+// the high frequencies of another.
+// image low: blurred first image.
+// image high, high_low: second image and its blurred version.
+// float s: weight of the high frequencies.
+// returns: clamp(low + (high - high_low) * s), in low's format.
+image hybrid_image(image low, image high, image high_low, float s)
+{
+    if (low.format != IMAGE_F32 || high.format != IMAGE_F32 || high_low.format != IMAGE_F32) {
+        // the expression reads floats, narrow inputs go through f32 copies
+        image l = convert_image(low, IMAGE_F32);
+        image h = convert_image(high, IMAGE_F32);
+        image hl = convert_image(high_low, IMAGE_F32);
+        image f = hybrid_image(l, h, hl, s);
+        image out = convert_image(f, low.format);
+        free_image(l);
+        free_image(h);
+        free_image(hl);
+        free_image(f);
+        return out;
+    }
+    return eval(clamp(img(low) + (img(high) - img(high_low)) * s));
+}
+
+// shift_image, scale_image then clamp_image on every channel, in one pass.
+// Changes im in place: clamp((im + shift) * scale).
+void shift_scale_clamp_image(image im, float shift, float scale)
+{
+    if (im.format != IMAGE_F32) {
+        image f = convert_image(im, IMAGE_F32);
+        shift_scale_clamp_image(f, shift, scale);
+        for (int c = 0; c < im.c; c++) {
+            for (int y = 0; y < im.h; y++) {
+                float_to_row(im, y, c, IMAGE_ROW(f, y, c));
+            }
+        }
+        free_image(f);
+        return;
+    }
+    assign(im, clamp((img(im) + shift) * scale));
+}
+
+}
@@ -1,8 +1,10 @@
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
 #include "image.h"
+#include "simd.h"
 
 
 float get_pixel(image im, int x, int y, int c) {
@@ -16,7 +18,10 @@ float get_pixel(image im, int x, int y, int c) {
     } else if (y >= im.h) {
         y = im.h - 1;
     }
-    return im.data[x + y * im.w + c * im.w * im.h];
+    if (im.format != IMAGE_F32) {
+        return format_get(im, x, y, c);
+    }
+    return IMAGE_ROW(im, y, c)[x];
 }
 
 void set_pixel(image im, int x, int y, int c, float v) {
@@ -30,50 +35,123 @@ void set_pixel(image im, int x, int y, int c, float v) {
     } else if (y >= im.h) {
         y = im.h - 1;
     }
-    im.data[x + y * im.w + c * im.w * im.h] = v;
+    if (im.format != IMAGE_F32) {
+        format_set(im, x, y, c, v);
+        return;
+    }
+    IMAGE_ROW(im, y, c)[x] = v;
 }
 
 image copy_image(image im) {
+    if (!is_packed_image(im)) {
+        return align_image(im);
+    }
+    if (im.format != IMAGE_F32) {
+        return pack_image(im);
+    }
     image copy = make_image(im.w, im.h, im.c);
     memcpy(copy.data, im.data, im.w * im.h * im.c * sizeof(float));
     return copy;
 }
 
+// Grayscale for narrow formats. u8 stays in integers with weights that
+// sum to 256, the others go through a float row.
+static void rgb_to_grayscale_format(image im, image gray) {
+    if (im.format == IMAGE_U8) {
+        for (int y = 0; y < im.h; y++) {
+            unsigned char *rr = IMAGE_ROW8(im, y, 0);
+            unsigned char *gg = IMAGE_ROW8(im, y, 1);
+            unsigned char *bb = IMAGE_ROW8(im, y, 2);
+            unsigned char *out = IMAGE_ROW8(gray, y, 0);
+            for (int x = 0; x < im.w; x++) {
+                out[x] = (77 * rr[x] + 150 * gg[x] + 29 * bb[x] + 128) >> 8;
+            }
+        }
+        return;
+    }
+    float *row = calloc(3 * im.w, sizeof(float));
+    for (int y = 0; y < im.h; y++) {
+        row_to_float(im, y, 0, row);
+        row_to_float(im, y, 1, row + im.w);
+        row_to_float(im, y, 2, row + 2 * im.w);
+        for (int x = 0; x < im.w; x++) {
+            row[x] = 0.299f * row[x] + 0.587f * row[x + im.w] + 0.114f * row[x + 2 * im.w];
+        }
+        float_to_row(gray, y, 0, row);
+    }
+    free(row);
+}
+
 image rgb_to_grayscale(image im) {
     assert(im.c == 3);
-    image gray = make_image(im.w, im.h, 1);
+    image gray = make_image_like(im, im.w, im.h, 1);
+    if (im.format != IMAGE_F32) {
+        rgb_to_grayscale_format(im, gray);
+        return gray;
+    }
     for (int y = 0; y < im.h; y++) {
-        for (int x = 0; x < im.w; x++) {
-            float r = im.data[x + y * im.w + 0 * im.w * im.h]; 
-            float g = im.data[x + y * im.w + 1 * im.w * im.h];
-            float b = im.data[x + y * im.w + 2 * im.w * im.h];
-            gray.data[x + y * im.w] = 0.299 * r + 0.587 * g + 0.114 * b;
+        float *rr = IMAGE_ROW(im, y, 0);
+        float *gg = IMAGE_ROW(im, y, 1);
+        float *bb = IMAGE_ROW(im, y, 2);
+        float *out = IMAGE_ROW(gray, y, 0);
+        int x = 0;
+#ifdef VLEN
+        vfloat wr = vset1(0.299f);
+        vfloat wg = vset1(0.587f);
+        vfloat wb = vset1(0.114f);
+        for (; x + VLEN <= im.w; x += VLEN) {
+            vfloat sum = vadd(vadd(vmul(wr, vload(rr + x)), vmul(wg, vload(gg + x))), vmul(wb, vload(bb + x)));
+            vstore(out + x, sum);
+        }
+#endif
+        for (; x < im.w; x++) {
+            out[x] = 0.299 * rr[x] + 0.587 * gg[x] + 0.114 * bb[x];
         }
     }
     return gray;
 }
 
 void shift_image(image im, int c, float v) {
+    if (im.format != IMAGE_F32) {
+        shift_scale_image(im, c, v, 1);
+        return;
+    }
     for (int y = 0; y < im.h; y++) {
+        float *row = IMAGE_ROW(im, y, c);
         for (int x = 0; x < im.w; x++) {
-            im.data[x + y * im.w + c * im.w * im.h] += v;
+            row[x] += v;
         }
     }
 }
 
 void clamp_image(image im) {
+    // u8 and u16 can only hold [0, 1]
+    if (im.format == IMAGE_U8 || im.format == IMAGE_U16) {
+        return;
+    }
+    float *buf = im.format == IMAGE_F32 ? 0 : calloc(im.w, sizeof(float));
     for (int c = 0; c < im.c; c++) {
         for (int y = 0; y < im.h; y++) {
+            float *row = buf;
+            if (buf) {
+                row_to_float(im, y, c, buf);
+            } else {
+                row = IMAGE_ROW(im, y, c);
+            }
             for (int x = 0; x < im.w; x++) {
-                if (im.data[x + y * im.w + c * im.w * im.h] < 0.0) {
-                    im.data[x + y * im.w + c * im.w * im.h] = 0.0;
-                } else if (im.data[x + y * im.w + c * im.w * im.h] > 1.0) {
-                    im.data[x + y * im.w + c * im.w * im.h] = 1.0;
+                if (row[x] < 0.0) {
+                    row[x] = 0.0;
+                } else if (row[x] > 1.0) {
+                    row[x] = 1.0;
                 }
                 
             }
+            if (buf) {
+                float_to_row(im, y, c, buf);
+            }
         }
     }
+    free(buf);
 }
 
 
@@ -86,136 +164,250 @@ float three_way_min(float a, float b, float c) {
     return (a < b) ? ( (a < c) ? a : c) : ( (b < c) ? b : c) ;
 }
 
-void rgb_to_hsv(image im) {
-    if (im.c != 3) {
-        printf("rgb_to_hsv failed: image channels must be 3\n");
+#ifdef VLEN
+// Convert VLEN pixels from rgb to hsv in place, without branches.
+// Matches the scalar code below: ties in the max pick r, then g, then b.
+static void rgb_to_hsv_vector(float *p0, float *p1, float *p2) {
+    vfloat zero = vset1(0);
+    vfloat one = vset1(1);
+    vfloat r = vload(p0);
+    vfloat g = vload(p1);
+    vfloat b = vload(p2);
+
+    vfloat v = vmax(vmax(r, g), b);
+    vfloat m = vmin(vmin(r, g), b);
+    vfloat c = vsub(v, m);
+    vfloat s = vselect(vcmplt(zero, v), vdiv(c, v), zero);
+
+    vfloat nonzero = vcmpneq(c, zero);
+    vfloat safe = vselect(nonzero, c, one);
+    vfloat hh = vadd(vdiv(vsub(r, g), safe), vset1(4));
+    hh = vselect(vcmpeq(v, g), vadd(vdiv(vsub(b, r), safe), vset1(2)), hh);
+    hh = vselect(vcmpeq(v, r), vdiv(vsub(g, b), safe), hh);
+    hh = vand(nonzero, hh);
+
+    vfloat h = vdiv(hh, vset1(6));
+    h = vadd(h, vand(vcmplt(hh, zero), one));
+    vfloat under = vcmplt(h, zero);
+    vfloat over = vcmple(one, h);
+    h = vadd(h, vand(under, one));
+    h = vsub(h, vand(over, one));
+
+    vstore(p0, h);
+    vstore(p1, s);
+    vstore(p2, v);
+}
+
+// Convert VLEN pixels from hsv to rgb in place, without branches.
+// The hue sector picks which of c, x2 and 0 each channel gets.
+static void hsv_to_rgb_vector(float *p0, float *p1, float *p2) {
+    vfloat zero = vset1(0);
+    vfloat one = vset1(1);
+    vfloat two = vset1(2);
+    vfloat h = vload(p0);
+    vfloat s = vload(p1);
+    vfloat v = vload(p2);
+
+    vfloat c = vmul(v, s);
+    vfloat m = vsub(v, c);
+    vfloat hh = vmul(h, vset1(6));
+
+    // The scalar loop only subtracts 2 while hh >= 2, negatives stay put.
+    vfloat temp = vsub(hh, vmul(two, vfloor(vmul(hh, vset1(0.5f)))));
+    temp = vselect(vcmplt(hh, zero), hh, temp);
+    temp = vsub(one, vabs(vsub(temp, one)));
+    vfloat x2 = vmul(c, temp);
+
+    vfloat k = vfloor(hh);
+    vfloat k0 = vcmpeq(k, zero);
+    vfloat k1 = vcmpeq(k, one);
+    vfloat k2 = vcmpeq(k, two);
+    vfloat k3 = vcmpeq(k, vset1(3));
+    vfloat k4 = vcmpeq(k, vset1(4));
+    vfloat k5 = vcmpeq(k, vset1(5));
+    vfloat rr = vor(vand(vor(k0, k5), c), vand(vor(k1, k4), x2));
+    vfloat gg = vor(vand(vor(k1, k2), c), vand(vor(k0, k3), x2));
+    vfloat bb = vor(vand(vor(k3, k4), c), vand(vor(k2, k5), x2));
+
+    vfloat gray = vcmpeq(c, zero);
+    vstore(p0, vselect(gray, v, vadd(rr, m)));
+    vstore(p1, vselect(gray, v, vadd(gg, m)));
+    vstore(p2, vselect(gray, v, vadd(bb, m)));
+}
+#endif
+
+// Calls f on the three channel rows of each row of im, going through
+// float rows when im is not IMAGE_F32.
+static void map_rgb_rows(image im, void (*f)(float *, float *, float *, int)) {
+    if (im.format == IMAGE_F32) {
+        for (int y = 0; y < im.h; y++) {
+            f(IMAGE_ROW(im, y, 0), IMAGE_ROW(im, y, 1), IMAGE_ROW(im, y, 2), im.w);
+        }
         return;
     }
+    float *row = calloc(3 * im.w, sizeof(float));
     for (int y = 0; y < im.h; y++) {
-        for (int x = 0; x < im.w; x++) {
-            float r = im.data[x + y * im.w + 0 * im.w * im.h]; 
-            float g = im.data[x + y * im.w + 1 * im.w * im.h];
-            float b = im.data[x + y * im.w + 2 * im.w * im.h];
+        row_to_float(im, y, 0, row);
+        row_to_float(im, y, 1, row + im.w);
+        row_to_float(im, y, 2, row + 2 * im.w);
+        f(row, row + im.w, row + 2 * im.w, im.w);
+        float_to_row(im, y, 0, row);
+        float_to_row(im, y, 1, row + im.w);
+        float_to_row(im, y, 2, row + 2 * im.w);
+    }
+    free(row);
+}
 
-            float v = three_way_max(r, g, b);
-            float m = three_way_min(r, g, b);
-            float c = v - m;
-            float s = 0; 
-            if (r > 0 || g > 0 || b > 0) {
-                s = c / v;
-            }
+static void rgb_to_hsv_row(float *row0, float *row1, float *row2, int w) {
+    int x = 0;
+#ifdef VLEN
+    for (; x + VLEN <= w; x += VLEN) {
+        rgb_to_hsv_vector(row0 + x, row1 + x, row2 + x);
+    }
+#endif
+    for (; x < w; x++) {
+        float r = row0[x];
+        float g = row1[x];
+        float b = row2[x];
 
-            float hh = 0; 
-            if (c != 0) {
-                if (v == r) {
-                    hh = (g - b) / c;
-                } else if (v == g) {
-                    hh = (b - r) / c + 2;
-                } else if (v == b) {
-                    hh = (r - g) / c + 4;
-                }
-            }
-            float h = 0; 
-            if (hh < 0) {
-                h = hh / 6 + 1;
-            } else {
-                h = hh / 6;
-            }
-            if (h < 0) {
-                h += 1;
-            } else if (h >= 1) {
-                h -= 1;
-            }
+        float v = three_way_max(r, g, b);
+        float m = three_way_min(r, g, b);
+        float c = v - m;
+        float s = 0; 
+        if (r > 0 || g > 0 || b > 0) {
+            s = c / v;
+        }
 
-            im.data[x + y * im.w + 0 * im.w * im.h] = h;
-            im.data[x + y * im.w + 1 * im.w * im.h] = s;
-            im.data[x + y * im.w + 2 * im.w * im.h] = v;
+        float hh = 0; 
+        if (c != 0) {
+            if (v == r) {
+                hh = (g - b) / c;
+            } else if (v == g) {
+                hh = (b - r) / c + 2;
+            } else if (v == b) {
+                hh = (r - g) / c + 4;
+            }
         }
+        float h = 0; 
+        if (hh < 0) {
+            h = hh / 6 + 1;
+        } else {
+            h = hh / 6;
+        }
+        if (h < 0) {
+            h += 1;
+        } else if (h >= 1) {
+            h -= 1;
+        }
+
+        row0[x] = h;
+        row1[x] = s;
+        row2[x] = v;
     }
 }
 
-void hsv_to_rgb(image im) {
+void rgb_to_hsv(image im) {
     if (im.c != 3) {
-        printf("hsv_to_rgb failed: image channels must be 3\n");
+        printf("rgb_to_hsv failed: image channels must be 3\n");
         return;
     }
-    for (int y = 0; y < im.h; y++) {
-        for (int x = 0; x < im.w; x++) {
-            float h = im.data[x + y * im.w + 0 * im.w * im.h]; 
-            float s = im.data[x + y * im.w + 1 * im.w * im.h];
-            float v = im.data[x + y * im.w + 2 * im.w * im.h];
+    map_rgb_rows(im, rgb_to_hsv_row);
+}
 
-            float c = v * s;
-            float m = v - c;
-            float hh = h * 6;
+static void hsv_to_rgb_row(float *row0, float *row1, float *row2, int w) {
+    int x = 0;
+#ifdef VLEN
+    for (; x + VLEN <= w; x += VLEN) {
+        hsv_to_rgb_vector(row0 + x, row1 + x, row2 + x);
+    }
+#endif
+    for (; x < w; x++) {
+        float h = row0[x];
+        float s = row1[x];
+        float v = row2[x];
 
-            float temp = hh;
-            while (temp >= 2.0) { 
-                temp -= 2.0;
-            }
-            temp -= 1.0;
-            if (temp < 0) {
-                temp = -temp;
-            }
-            temp = 1.0 - temp;
-            float x2 = c * temp;
-
-            float rr = 0; 
-            float gg = 0; 
-            float bb = 0;
-            
-            if (hh >= 0 && hh < 1) {
-                rr = c;
-                gg = x2;
-                bb = 0;
-            } else if (hh >= 1 && hh < 2) {
-                rr = x2;
-                gg = c;
-                bb = 0;
-            } else if (hh >= 2 && hh < 3) {
-                rr = 0; 
-                gg = c;
-                bb = x2;
-            } else if (hh >= 3 && hh < 4) {
-                rr = 0;
-                gg = x2;
-                bb = c;
-            } else if (hh >= 4 && hh < 5) {
-                rr = x2;
-                gg = 0; 
-                bb = c;
-            } else if (hh >= 5 && hh < 6) {
-                rr = c;
-                gg = 0;
-                bb = x2;
-            } 
-            
-            float r = 0; 
-            float g = 0; 
-            float b = 0;
-
-            if (c == 0) {
-                r = v;
-                g = v;
-                b = v;
-            } else {
-                r = rr + m;
-                g = gg + m;
-                b = bb + m;
-            }
+        float c = v * s;
+        float m = v - c;
+        float hh = h * 6;
 
-            im.data[x + y * im.w + 0 * im.w * im.h] = r;
-            im.data[x + y * im.w + 1 * im.w * im.h] = g;
-            im.data[x + y * im.w + 2 * im.w * im.h] = b;
+        float temp = hh;
+        while (temp >= 2.0) { 
+            temp -= 2.0;
+        }
+        temp -= 1.0;
+        if (temp < 0) {
+            temp = -temp;
         }
+        temp = 1.0 - temp;
+        float x2 = c * temp;
+
+        float rr = 0; 
+        float gg = 0; 
+        float bb = 0;
+        
+        if (hh >= 0 && hh < 1) {
+            rr = c;
+            gg = x2;
+            bb = 0;
+        } else if (hh >= 1 && hh < 2) {
+            rr = x2;
+            gg = c;
+            bb = 0;
+        } else if (hh >= 2 && hh < 3) {
+            rr = 0; 
+            gg = c;
+            bb = x2;
+        } else if (hh >= 3 && hh < 4) {
+            rr = 0;
+            gg = x2;
+            bb = c;
+        } else if (hh >= 4 && hh < 5) {
+            rr = x2;
+            gg = 0; 
+            bb = c;
+        } else if (hh >= 5 && hh < 6) {
+            rr = c;
+            gg = 0;
+            bb = x2;
+        } 
+        
+        float r = 0; 
+        float g = 0; 
+        float b = 0;
+
+        if (c == 0) {
+            r = v;
+            g = v;
+            b = v;
+        } else {
+            r = rr + m;
+            g = gg + m;
+            b = bb + m;
+        }
+
+        row0[x] = r;
+        row1[x] = g;
+        row2[x] = b;
     }
+}
 
+void hsv_to_rgb(image im) {
+    if (im.c != 3) {
+        printf("hsv_to_rgb failed: image channels must be 3\n");
+        return;
+    }
+    map_rgb_rows(im, hsv_to_rgb_row);
 }
 
 void scale_image(image im, int c, float v) {
+    if (im.format != IMAGE_F32) {
+        shift_scale_image(im, c, 0, v);
+        return;
+    }
     for (int y = 0; y < im.h; y++) {
+        float *row = IMAGE_ROW(im, y, c);
         for (int x = 0; x < im.w; x++) {
-            im.data[x + y * im.w + c * im.w * im.h] *= v;
+            row[x] *= v;
         }
     }
 }
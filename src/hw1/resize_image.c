@@ -1,5 +1,8 @@
 #include <math.h>
+#include <stdlib.h>
+#include <assert.h>
 #include "image.h"
+#include "simd.h"
 
 
 float nn_interpolate(image im, float x, float y, int c) {
@@ -7,19 +10,7 @@ float nn_interpolate(image im, float x, float y, int c) {
 }
 
 image nn_resize(image im, int w, int h) {
-    image ret = make_image(w, h, im.c);
-    float w_gap = 1.0 * im.w / ret.w;
-    float h_gap = 1.0 * im.h / ret.h;
-    for (int c = 0; c < im.c; c++) {
-        for (int y = 0; y < ret.h; y++) {
-            for (int x = 0; x < ret.w; x++) {
-                float a = -0.5 + w_gap * (x + 0.5);
-                float b = -0.5 + h_gap * (y + 0.5);
-                set_pixel(ret, x, y, c, nn_interpolate(im, a, b, c));
-            }
-        }
-    }
-    return ret;
+    return resample_image(im, w, h, RESIZE_NEAREST, 0);
 }
 
 float bilinear_interpolate(image im, float x, float y, int c) {
@@ -27,10 +18,20 @@ float bilinear_interpolate(image im, float x, float y, int c) {
     int x_r = ceil(x);
     int y_l = floor(y);
     int y_r = ceil(y);
-    float ul = get_pixel(im, x_l, y_l, c);
-    float ur = get_pixel(im, x_r, y_l, c);
-    float dl = get_pixel(im, x_l, y_r, c);
-    float dr = get_pixel(im, x_r, y_r, c);
+    float ul, ur, dl, dr;
+    if (im.format == IMAGE_F32 && x_l >= 0 && y_l >= 0 && x_r < im.w && y_r < im.h) {
+        float *top = IMAGE_ROW(im, y_l, c);
+        float *bot = IMAGE_ROW(im, y_r, c);
+        ul = top[x_l];
+        ur = top[x_r];
+        dl = bot[x_l];
+        dr = bot[x_r];
+    } else {
+        ul = get_pixel(im, x_l, y_l, c);
+        ur = get_pixel(im, x_r, y_l, c);
+        dl = get_pixel(im, x_l, y_r, c);
+        dr = get_pixel(im, x_r, y_r, c);
+    }
 
     float q1 = dl * (y - y_l) + ul * (y_r - y);
     float q2 = dr * (y - y_l) + ur * (y_r - y);
@@ -38,18 +39,278 @@ float bilinear_interpolate(image im, float x, float y, int c) {
 }
 
 image bilinear_resize(image im, int w, int h) {
-    image ret = make_image(w, h, im.c);
-    float w_gap = 1.0 * im.w / ret.w;
-    float h_gap = 1.0 * im.h / ret.h;
-    for (int c = 0; c < im.c; c++) {
-        for (int y = 0; y < ret.h; y++) {
-            for (int x = 0; x < ret.w; x++) {
-                float a = -0.5 + w_gap * (x + 0.5);
-                float b = -0.5 + h_gap * (y + 0.5);
-                set_pixel(ret, x, y, c, bilinear_interpolate(im, a, b, c));
+    return resample_image(im, w, h, RESIZE_BILINEAR, 0);
+}
+
+// Separable resampling. Along each axis every output pixel is a weighted
+// sum of a few input pixels whose indices and weights depend only on the
+// output coordinate, so they are worked out once per axis into tables
+// laid out tap-major: tap k of every output column is contiguous, and the
+// inner loops run over whole rows. Rows are resized horizontally into a
+// temporary image first, then output rows blend whole rows of it.
+
+typedef struct {
+    int n, taps;
+    int *index;     // taps x n, clamped to the input
+    float *weight;  // taps x n, each output's weights sum to 1
+} resample_table;
+
+static float cubic_kernel(float x) {
+    // Keys (1981) with a = -0.5, the usual bicubic
+    x = fabsf(x);
+    if (x < 1) return (1.5f * x - 2.5f) * x * x + 1;
+    if (x < 2) return ((-0.5f * x + 2.5f) * x - 4) * x + 2;
+    return 0;
+}
+
+static float sinc(float x) {
+    if (x == 0) return 1;
+    x *= M_PI;
+    return sinf(x) / x;
+}
+
+static float resample_kernel(RESIZE_FILTER f, float x) {
+    switch (f) {
+        case RESIZE_BILINEAR: return MAX(0, 1 - fabsf(x));
+        case RESIZE_BICUBIC: return cubic_kernel(x);
+        case RESIZE_LANCZOS3: return fabsf(x) < 3 ? sinc(x) * sinc(x / 3) : 0;
+        default: return fabsf(x) <= 0.5f ? 1 : 0;
+    }
+}
+
+static float resample_radius(RESIZE_FILTER f) {
+    switch (f) {
+        case RESIZE_BILINEAR: return 1;
+        case RESIZE_BICUBIC: return 2;
+        case RESIZE_LANCZOS3: return 3;
+        default: return 0.5f;
+    }
+}
+
+// Taps for resizing n_in pixels to n_out with pixel centers lined up.
+// int antialias: stretch the kernel by the scale when shrinking so every
+// input pixel contributes, otherwise it only interpolates.
+static resample_table make_resample_table(int n_in, int n_out, RESIZE_FILTER f, int antialias) {
+    resample_table t;
+    float gap = 1.0 * n_in / n_out;
+    float stretch = antialias && gap > 1 ? gap : 1;
+    float support = f == RESIZE_NEAREST ? 0 : resample_radius(f) * stretch;
+    // a box overlaps every pixel whose edge it reaches, so it takes one
+    // pixel more each side than a kernel that is 0 at the edge
+    float reach = f == RESIZE_AREA ? support + 0.5f : support;
+    t.n = n_out;
+    t.taps = f == RESIZE_NEAREST ? 1 : (int)ceil(2 * support) + (f == RESIZE_AREA);
+    t.index = calloc((size_t)t.taps * n_out, sizeof(int));
+    t.weight = calloc((size_t)t.taps * n_out, sizeof(float));
+    for (int x = 0; x < n_out; x++) {
+        float center = -0.5 + gap * (x + 0.5);
+        if (f == RESIZE_NEAREST) {
+            t.index[x] = MIN(MAX((int)round(center), 0), n_in - 1);
+            t.weight[x] = 1;
+            continue;
+        }
+        // every kernel is 0 at the edge of its reach, so only the pixels
+        // strictly inside it get taps
+        int first = floor(center - reach) + 1;
+        float total = 0;
+        for (int k = 0; k < t.taps; k++) {
+            int j = first + k;
+            float w;
+            if (f == RESIZE_AREA) {
+                // overlap of input pixel j with the output pixel's footprint
+                w = MAX(0, MIN(j + 0.5f, center + support) - MAX(j - 0.5f, center - support));
+            } else {
+                w = resample_kernel(f, (j - center) / stretch);
+            }
+            t.index[k * n_out + x] = MIN(MAX(j, 0), n_in - 1);
+            t.weight[k * n_out + x] = w;
+            total += w;
+        }
+        for (int k = 0; k < t.taps; k++) {
+            t.weight[k * n_out + x] /= total;
+        }
+    }
+    return t;
+}
+
+static void free_resample_table(resample_table t) {
+    free(t.index);
+    free(t.weight);
+}
+
+// One row through a table, tap by tap over the whole row.
+static void resample_row(const float *src, float *out, const resample_table *t) {
+    const int *idx = t->index;
+    const float *wt = t->weight;
+    for (int x = 0; x < t->n; x++) {
+        out[x] = wt[x] * src[idx[x]];
+    }
+    for (int k = 1; k < t->taps; k++) {
+        idx = t->index + k * t->n;
+        wt = t->weight + k * t->n;
+        for (int x = 0; x < t->n; x++) {
+            out[x] += wt[x] * src[idx[x]];
+        }
+    }
+}
+
+#ifdef VLEN
+#define RESAMPLE_ROWS VLEN
+// VLEN rows through a table at once. The rows are interleaved so column
+// j of all of them is one vector at buf + VLEN*j, then every tap is a
+// load and a multiply-add by the broadcast weight, no gathers.
+// float *buf: VLEN*n_in floats, float *acc: VLEN*t->n floats.
+static void resample_row_vectors(const float **src, float **out, int n_in, const resample_table *t, float *buf, float *acc) {
+    for (int j = 0; j < n_in; j++) {
+        for (int r = 0; r < VLEN; r++) {
+            buf[VLEN * j + r] = src[r][j];
+        }
+    }
+    for (int x = 0; x < t->n; x++) {
+        vfloat s = vmul(vset1(t->weight[x]), vload(buf + VLEN * t->index[x]));
+        for (int k = 1; k < t->taps; k++) {
+            int i = k * t->n + x;
+            s = vadd(s, vmul(vset1(t->weight[i]), vload(buf + VLEN * t->index[i])));
+        }
+        vstore(acc + VLEN * x, s);
+    }
+    for (int x = 0; x < t->n; x++) {
+        for (int r = 0; r < VLEN; r++) {
+            out[r][x] = acc[VLEN * x + r];
+        }
+    }
+}
+#else
+#define RESAMPLE_ROWS 1
+#endif
+
+// Input rows [*in_y0, *in_y1) that output rows [y0, y1) of an in_h to h
+// resample read, so a strip holding them is enough for resample_rows.
+void resample_rows_needed(int in_h, int h, RESIZE_FILTER f, int antialias, int y0, int y1, int *in_y0, int *in_y1) {
+    if (y1 <= y0) {
+        // no output rows read nothing
+        *in_y0 = *in_y1 = 0;
+        return;
+    }
+    resample_table ty = make_resample_table(in_h, h, f, antialias);
+    int lo = in_h, hi = 0;
+    for (int k = 0; k < ty.taps; k++) {
+        for (int y = y0; y < y1; y++) {
+            lo = MIN(lo, ty.index[k * h + y]);
+            hi = MAX(hi, ty.index[k * h + y] + 1);
+        }
+    }
+    *in_y0 = lo;
+    *in_y1 = hi;
+    free_resample_table(ty);
+}
+
+// Output rows [y0, y1) of resampling an in_h tall image to w x h.
+// image strip: rows [in_y0, in_y0 + strip.h) of the input, covering what
+//              resample_rows_needed asks for.
+// returns: w x (y1 - y0) image in the same format as strip.
+image resample_rows(image strip, int in_y0, int in_h, int w, int h, int y0, int y1, RESIZE_FILTER f, int antialias) {
+    int n = MAX(y1 - y0, 0);
+    image ret = make_image_like(strip, w, n, strip.c);
+    if (n == 0) {
+        return ret;
+    }
+    resample_table tx = make_resample_table(strip.w, w, f, antialias);
+    resample_table ty = make_resample_table(in_h, h, f, antialias);
+    int lo, hi;
+    resample_rows_needed(in_h, h, f, antialias, y0, y1, &lo, &hi);
+    assert(lo >= in_y0 && hi <= in_y0 + strip.h);
+    image mid = make_image(w, hi - lo, strip.c);
+    int narrow = strip.format != IMAGE_F32;
+
+    // horizontal pass: every input row, all channels, to w columns,
+    // RESAMPLE_ROWS rows at a time
+    int rows = (hi - lo) * strip.c;
+    int groups = (rows + RESAMPLE_ROWS - 1) / RESAMPLE_ROWS;
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *wide = narrow ? calloc((size_t)RESAMPLE_ROWS * strip.w, sizeof(float)) : 0;
+#ifdef VLEN
+        float *buf = calloc((size_t)VLEN * strip.w, sizeof(float));
+        float *acc = calloc((size_t)VLEN * w, sizeof(float));
+#endif
+        #pragma omp for schedule(static)
+        for (int g = 0; g < groups; g++) {
+            const float *src[RESAMPLE_ROWS];
+            float *out[RESAMPLE_ROWS];
+            int n = MIN(RESAMPLE_ROWS, rows - g * RESAMPLE_ROWS);
+            for (int r = 0; r < n; r++) {
+                int y = lo + (g * RESAMPLE_ROWS + r) / strip.c;
+                int c = (g * RESAMPLE_ROWS + r) % strip.c;
+                if (narrow) {
+                    row_to_float(strip, y - in_y0, c, wide + r * strip.w);
+                    src[r] = wide + r * strip.w;
+                } else {
+                    src[r] = IMAGE_ROW(strip, y - in_y0, c);
+                }
+                out[r] = IMAGE_ROW(mid, y - lo, c);
+            }
+#ifdef VLEN
+            if (n == VLEN) {
+                resample_row_vectors(src, out, strip.w, &tx, buf, acc);
+                continue;
+            }
+#endif
+            for (int r = 0; r < n; r++) {
+                resample_row(src[r], out[r], &tx);
+            }
+        }
+        free(wide);
+#ifdef VLEN
+        free(buf);
+        free(acc);
+#endif
+    }
+
+    // vertical pass: each output row blends whole rows of mid
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *acc = narrow ? calloc(w, sizeof(float)) : 0;
+        #pragma omp for schedule(static)
+        for (int y = y0; y < y1; y++) {
+            for (int c = 0; c < strip.c; c++) {
+                float *out = narrow ? acc : IMAGE_ROW(ret, y - y0, c);
+                const float *src = IMAGE_ROW(mid, ty.index[y] - lo, c);
+                float wy = ty.weight[y];
+                for (int x = 0; x < w; x++) {
+                    out[x] = wy * src[x];
+                }
+                for (int k = 1; k < ty.taps; k++) {
+                    src = IMAGE_ROW(mid, ty.index[k * h + y] - lo, c);
+                    wy = ty.weight[k * h + y];
+                    for (int x = 0; x < w; x++) {
+                        out[x] += wy * src[x];
+                    }
+                }
+                if (narrow) {
+                    float_to_row(ret, y - y0, c, acc);
+                }
             }
         }
+        free(acc);
     }
+
+    free_image(mid);
+    free_resample_table(tx);
+    free_resample_table(ty);
     return ret;
 }
 
+// Resize an image with a resampling filter.
+// RESIZE_FILTER f: kernel, RESIZE_AREA averages the input under each
+//                  output pixel.
+// int antialias: widen the kernel when shrinking, see make_resample_table.
+// returns: w x h image in the same format as im, edges clamped.
+image resample_image(image im, int w, int h, RESIZE_FILTER f, int antialias) {
+    return resample_rows(im, 0, im.h, w, h, 0, h, f, antialias);
+}
+
+// Resize with a filter, antialiased when shrinking.
+image resize_image(image im, int w, int h, RESIZE_FILTER f) {
+    return resample_image(im, w, h, f, 1);
+}
@@ -4,29 +4,24 @@
 #include <math.h>
 #include <assert.h>
 #include "image.h"
+#include "simd.h"
 
 #include <time.h>
+#include <pthread.h>
 #include <stdlib.h>
 
 #define TWOPI 6.2831853
 
 
+// Scale each channel to sum to 1, or make it flat if it sums to 0.
 void l1_normalize(image im) {
     for (int c = 0; c < im.c; c++) {
-        float sum = 0.0;
-        for (int y = 0; y < im.h; y++) {
-            for (int x = 0; x < im.w; x++) {
-                sum += get_pixel(im, x, y, c);
-            }
-        }
-        for (int y = 0; y < im.h; y++) {
-            for (int x = 0; x < im.w; x++) {
-                if (sum != 0) {
-                    set_pixel(im, x, y, c, get_pixel(im, x, y, c) / sum);
-                } else {
-                    set_pixel(im, x, y, c, 1.0 / im.w / im.h);
-                }
-            }
+        image_stats s = reduce_image(im, c);
+        if (s.sum != 0) {
+            shift_scale_image(im, c, 0, 1 / s.sum);
+        } else {
+            shift_scale_image(im, c, 0, 0);
+            shift_scale_image(im, c, 1.0 / im.w / im.h, 1);
         }
     }
 }
@@ -41,43 +36,271 @@ image make_box_filter(int w) {
     return ret;
 }
 
+// Accumulate one filter tap into output columns [from, to) of a row,
+// for the columns where the tap may fall outside the image.
+static void border_taps(float *out, const float *src, float f, int off, int from, int to, int w, BORDER border) {
+    for (int x = from; x < to; x++) {
+        int sx = border_index(x + off, w, border);
+        if (sx >= 0) {
+            out[x] += f * src[sx];
+        }
+    }
+}
+
+// Accumulate the 1d convolution of a w wide row with n taps centered on
+// n/2 into out. Columns whose taps all land inside the row run without
+// bounds checks, only the n/2 columns on each side go through border_index.
+static void convolve_row(float *out, const float *src, const float *f, int n, int w, BORDER border) {
+    int r = n / 2;
+    // Interior columns [x0, x1) have every tap inside the row.
+    int x0 = MIN(r, w);
+    int x1 = MAX(x0, w - (n - 1 - r));
+    for (int a = 0; a < n; a++) {
+        float fa = f[a];
+        int off = a - r;
+        for (int x = x0; x < x1; x++) {
+            out[x] += fa * src[x + off];
+        }
+        border_taps(out, src, fa, off, 0, x0, w, border);
+        border_taps(out, src, fa, off, x1, w, w, border);
+    }
+}
+
+// Split a filter into a row and a column filter if it is rank 1, like box,
+// Gaussian and Sobel filters. The largest tap picks the row and column the
+// two factors are read from, then every tap has to match their product.
+// returns: 1 and fills in row (w x 1) and col (1 x h) if separable, else 0.
+int separate_filter(image filter, image *row, image *col) {
+    if (filter.c != 1) {
+        return 0;
+    }
+    int px = 0, py = 0;
+    float big = 0;
+    for (int y = 0; y < filter.h; y++) {
+        for (int x = 0; x < filter.w; x++) {
+            float v = fabsf(get_pixel(filter, x, y, 0));
+            if (v > big) {
+                big = v;
+                px = x;
+                py = y;
+            }
+        }
+    }
+    if (big == 0) {
+        return 0;
+    }
+    image r = make_image(filter.w, 1, 1);
+    image c = make_image(1, filter.h, 1);
+    float pivot = get_pixel(filter, px, py, 0);
+    for (int x = 0; x < filter.w; x++) {
+        r.data[x] = get_pixel(filter, x, py, 0) / pivot;
+    }
+    for (int y = 0; y < filter.h; y++) {
+        c.data[y] = get_pixel(filter, px, y, 0);
+    }
+    for (int y = 0; y < filter.h; y++) {
+        for (int x = 0; x < filter.w; x++) {
+            if (fabsf(c.data[y] * r.data[x] - get_pixel(filter, x, y, 0)) > 1e-5 * big) {
+                free_image(r);
+                free_image(c);
+                return 0;
+            }
+        }
+    }
+    *row = r;
+    *col = c;
+    return 1;
+}
+
+#define TILE 16
+// Bytes of rows a thread of the direct path works on at once, about L2.
+#define BAND_BYTES (256 << 10)
+
+// Convolve the rows of channel c of im with a 1d filter and write them
+// transposed into channel oc of out (out.w == im.h, out.h == im.w), so the
+// same row code filters the columns on a second call. Rows go TILE at a
+// time through a buffer and leave as TILE wide strips, so reads and writes
+// both stay sequential. Threads take strips of TILE rows.
+static void convolve_rows_transposed(image im, int c, const float *f, int n, BORDER border,
+                                     image out, int oc) {
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *buf = calloc(TILE * im.w, sizeof(float));
+        float *wide = im.format != IMAGE_F32 ? calloc(im.w, sizeof(float)) : 0;
+        #pragma omp for schedule(static)
+        for (int y0 = 0; y0 < im.h; y0 += TILE) {
+            int rows = MIN(TILE, im.h - y0);
+            for (int t = 0; t < rows; t++) {
+                const float *src = wide;
+                if (wide) {
+                    row_to_float(im, y0 + t, c, wide);
+                } else {
+                    src = IMAGE_ROW(im, y0 + t, c);
+                }
+                float *row = buf + t * im.w;
+                memset(row, 0, im.w * sizeof(float));
+                convolve_row(row, src, f, n, im.w, border);
+            }
+            for (int x = 0; x < im.w; x++) {
+                float *o = IMAGE_ROW(out, x, oc) + y0;
+                for (int t = 0; t < rows; t++) {
+                    o[t] = buf[t * im.w + x];
+                }
+            }
+        }
+        free(buf);
+        free(wide);
+    }
+}
+
+// Convolve with a separable filter, a row pass then a column pass.
+// image row, col: 1d filters, their taps are read in order whatever their shape.
+image convolve_separable(image im, image row, image col, int preserve) {
+    return convolve_separable_border(im, row, col, preserve, BORDER_CLAMP);
+}
+
+// The taps of a 1d filter in order, read through its rows so padded,
+// strided and narrow filters give their taps and nothing else.
+static float *filter_taps(image f) {
+    float *taps = calloc((size_t)f.w * f.h, sizeof(float));
+    for (int y = 0; y < f.h; y++) {
+        row_to_float(f, y, 0, taps + (size_t)y * f.w);
+    }
+    return taps;
+}
+
+image convolve_separable_border(image im, image row, image col, int preserve, BORDER border) {
+    int narrow = im.format != IMAGE_F32;
+    image ret;
+    if (preserve) {
+        ret = make_image_like(im, im.w, im.h, im.c);
+    } else if (narrow) {
+        ret = make_image(im.w, im.h, 1);
+    } else {
+        ret = make_image_like(im, im.w, im.h, 1);
+    }
+    image t = make_image(im.h, im.w, 1);
+    image s = make_image(im.w, im.h, 1);
+    float *rtaps = filter_taps(row);
+    float *ctaps = filter_taps(col);
+
+    for (int c = 0; c < im.c; c++) {
+        convolve_rows_transposed(im, c, rtaps, row.w * row.h, border, t, 0);
+        if (preserve && !narrow) {
+            convolve_rows_transposed(t, 0, ctaps, col.w * col.h, border, ret, c);
+            continue;
+        }
+        convolve_rows_transposed(t, 0, ctaps, col.w * col.h, border, s, 0);
+        #pragma omp parallel for num_threads(get_image_threads())
+        for (int y = 0; y < im.h; y++) {
+            float *src = IMAGE_ROW(s, y, 0);
+            if (preserve) {
+                float_to_row(ret, y, c, src);
+            } else {
+                float *total = IMAGE_ROW(ret, y, 0);
+                for (int x = 0; x < im.w; x++) {
+                    total[x] += src[x];
+                }
+            }
+        }
+    }
+
+    free(rtaps);
+    free(ctaps);
+    free_image(t);
+    free_image(s);
+    return ret;
+}
+
 image convolve_image(image im, image filter, int preserve) {
+    return convolve_image_border(im, filter, preserve, BORDER_CLAMP);
+}
+
+// Convolve an image, reading past its edges with a border policy.
+// Rank 1 filters big enough to pay for two passes go through
+// convolve_separable, 3x3 filters are cheaper done directly, and big
+// filters that don't separate go through the FFT when it costs less.
+image convolve_image_border(image im, image filter, int preserve, BORDER border) {
     assert(filter.c == im.c || filter.c == 1);
 
+    image row, col;
+    if (filter.w * filter.h > 2 * (filter.w + filter.h) && separate_filter(filter, &row, &col)) {
+        image ret = convolve_separable_border(im, row, col, preserve, border);
+        free_image(row);
+        free_image(col);
+        return ret;
+    }
+    if (use_fft_convolve(im, filter, preserve)) {
+        return convolve_fft_border(im, filter, preserve, border);
+    }
+
+    // Narrow formats keep their format when filtering each channel, but a
+    // channel sum is a feature map rather than a picture so it stays float.
+    int narrow = im.format != IMAGE_F32;
     image ret;
     if (preserve) {
-        ret = make_image(im.w, im.h, im.c);
-    } else {
+        ret = make_image_like(im, im.w, im.h, im.c);
+    } else if (narrow) {
         ret = make_image(im.w, im.h, 1);
+    } else {
+        ret = make_image_like(im, im.w, im.h, 1);
+    }
+    if (im.w * im.h * im.c == 0) {
+        return ret;
     }
 
-    for (int h = 0; h < im.h; h++) {
-        for (int w = 0; w < im.w; w++) {
-            float total_sum = 0.0;
-            for (int c = 0; c < im.c; c++) {
-                float sum = 0.0;
-                for (int b = 0; b < filter.h; b++) {  // b: kernel index h direction
-                    for (int a = 0; a < filter.w; a++) {  // a: kernel index w direction
-                        int x = w - filter.w/2 + a;  // pixel w direction
-                        int y = h - filter.h/2 + b;  // pixel h direction
-                        if (filter.c == 1) { 
-                            sum += get_pixel(im, x, y, c) * get_pixel(filter, a, b, 0);
+    // Threads take bands of output rows. A band is sized so the input rows
+    // it reads, in every channel, stay in L2 while the band is filtered.
+    int ry = filter.h / 2;
+    int band = MAX(1, BAND_BYTES / (int)(im.w * im.c * sizeof(float)) - filter.h);
+    int threads = get_image_threads();
+    band = MIN(band, MAX(1, im.h / (4 * threads)));
+
+    #pragma omp parallel num_threads(threads)
+    {
+        float *acc = calloc(im.w, sizeof(float));
+        float *wide = narrow ? calloc(im.w, sizeof(float)) : 0;
+        #pragma omp for schedule(dynamic)
+        for (int y0 = 0; y0 < im.h; y0 += band) {
+            for (int h = y0; h < MIN(y0 + band, im.h); h++) {
+                // Channels add into the row in order, so the preserve = 0
+                // sum is the same whatever the thread count.
+                for (int c = 0; c < im.c; c++) {
+                    int fc = filter.c == 1 ? 0 : c;
+                    float *out = acc;
+                    if (preserve && !narrow) {
+                        out = IMAGE_ROW(ret, h, c);
+                    } else {
+                        memset(acc, 0, im.w * sizeof(float));
+                    }
+                    for (int b = 0; b < filter.h; b++) {  // b: kernel index h direction
+                        int y = border_index(h - ry + b, im.h, border);
+                        if (y < 0) {
+                            continue;
+                        }
+                        float *src = wide;
+                        if (narrow) {
+                            row_to_float(im, y, c, wide);
                         } else {
-                            sum += get_pixel(im, x, y, c) * get_pixel(filter, a, b, c);
+                            src = IMAGE_ROW(im, y, c);
+                        }
+                        convolve_row(out, src, IMAGE_ROW(filter, b, fc), filter.w, im.w, border);
+                    }
+                    if (preserve && narrow) {
+                        float_to_row(ret, h, c, acc);
+                    }
+                    if (!preserve) {
+                        float *total = IMAGE_ROW(ret, h, 0);
+                        for (int w = 0; w < im.w; w++) {
+                            total[w] += acc[w];
                         }
                     }
                 }
-                if (preserve) {
-                    set_pixel(ret, w, h, c, sum);
-                }
-                total_sum += sum;
-            }
-            if (!preserve) {
-                set_pixel(ret, w, h, 0, total_sum);
             }
         }
+        free(acc);
+        free(wide);
     }
-
     return ret;
 }
 
@@ -141,14 +364,18 @@ image make_gaussian_filter(float sigma) {
 }
 
 image add_image(image a, image b) {
+    assert(a.format == IMAGE_F32 && b.format == IMAGE_F32);
     if (a.w != b.w || a.h != b.h || a.c != b.c) {
         return make_image(0,0,0);
     }
-    image ret = make_image(a.w, a.h, a.c);
+    image ret = make_image_like(a, a.w, a.h, a.c);
     for (int c = 0; c < a.c; c++) {
         for (int y = 0; y < a.h; y++) {
+            float *ra = IMAGE_ROW(a, y, c);
+            float *rb = IMAGE_ROW(b, y, c);
+            float *out = IMAGE_ROW(ret, y, c);
             for (int x = 0; x < a.w; x++) {
-                set_pixel(ret, x, y, c, get_pixel(a, x, y, c) + get_pixel(b, x, y, c));
+                out[x] = ra[x] + rb[x];
             }
         }
     }
@@ -156,14 +383,18 @@ image add_image(image a, image b) {
 }
 
 image sub_image(image a, image b) {
+    assert(a.format == IMAGE_F32 && b.format == IMAGE_F32);
     if (a.w != b.w || a.h != b.h || a.c != b.c) {
         return make_image(0,0,0);
     }
-    image ret = make_image(a.w, a.h, a.c);
+    image ret = make_image_like(a, a.w, a.h, a.c);
     for (int c = 0; c < a.c; c++) {
         for (int y = 0; y < a.h; y++) {
+            float *ra = IMAGE_ROW(a, y, c);
+            float *rb = IMAGE_ROW(b, y, c);
+            float *out = IMAGE_ROW(ret, y, c);
             for (int x = 0; x < a.w; x++) {
-                set_pixel(ret, x, y, c, get_pixel(a, x, y, c) - get_pixel(b, x, y, c));
+                out[x] = ra[x] - rb[x];
             }
         }
     }
@@ -192,87 +423,287 @@ image make_gy_filter() {
     return ret;
 }
 
+// Stretch an image to [0, 1] over all channels, or to 0 if it is flat.
 void feature_normalize(image im) {
-    float min = get_pixel(im, 0, 0, 0);
-    float max = get_pixel(im, 0, 0, 0);
+    image_stats s = reduce_image(im, -1);
+    float range = s.max - s.min;
+    if (range != 0) {
+        shift_scale_image(im, -1, -s.min, 1 / range);
+    } else {
+        shift_scale_image(im, -1, 0, 0);
+    }
+}
+
+// Sobel gradients of row y, summed over channels like convolve_image with
+// make_gx_filter and make_gy_filter and preserve = 0, borders clamped.
+// Each channel's three rows are combined down the columns first, s with
+// [1 2 1] and d with [-1 0 1], so the 3x3 taps become 4 adds per pixel
+// per direction: gx = s[x+1] - s[x-1], gy = d[x-1] + 2 d[x] + d[x+1].
+// rows: 3 * im.w scratch for narrow formats.
+static void sobel_row(image im, int y, float *gx, float *gy, float *s, float *d, float *rows) {
+    int w = im.w;
+    int y0 = border_index(y - 1, im.h, BORDER_CLAMP);
+    int y2 = border_index(y + 1, im.h, BORDER_CLAMP);
+    memset(gx, 0, w * sizeof(float));
+    memset(gy, 0, w * sizeof(float));
     for (int c = 0; c < im.c; c++) {
-        for (int y = 0; y < im.h; y++) {
-            for (int x = 0; x < im.w; x++) {
-                min = MIN(min, get_pixel(im, x, y, c));
-                max = MAX(max, get_pixel(im, x, y, c));
-            }
+        const float *r0, *r1, *r2;
+        if (im.format == IMAGE_F32) {
+            r0 = IMAGE_ROW(im, y0, c);
+            r1 = IMAGE_ROW(im, y, c);
+            r2 = IMAGE_ROW(im, y2, c);
+        } else {
+            row_to_float(im, y0, c, rows);
+            row_to_float(im, y, c, rows + w);
+            row_to_float(im, y2, c, rows + 2 * w);
+            r0 = rows;
+            r1 = rows + w;
+            r2 = rows + 2 * w;
+        }
+        for (int x = 0; x < w; x++) {
+            s[x] = r0[x] + 2 * r1[x] + r2[x];
+            d[x] = r2[x] - r0[x];
+        }
+        for (int x = 1; x < w - 1; x++) {
+            gx[x] += s[x + 1] - s[x - 1];
+            gy[x] += d[x - 1] + 2 * d[x] + d[x + 1];
+        }
+        for (int x = 0; x < w; x += MAX(1, w - 1)) {
+            int xl = MAX(x - 1, 0);
+            int xr = MIN(x + 1, w - 1);
+            gx[x] += s[xr] - s[xl];
+            gy[x] += d[xl] + 2 * d[x] + d[xr];
         }
     }
-    for (int c = 0; c < im.c; c++) {
-        float range = max - min;
+}
+
+// atan(z) for |z| <= 1, Abramowitz and Stegun 4.4.49, |error| <= 1.2e-5.
+#define ATAN_POLY(z, z2) ((z) * (0.9998660f + (z2) * (-0.3302995f + (z2) * (0.1801410f \
+                          + (z2) * (-0.0851330f + (z2) * 0.0208351f)))))
+
+// atan2 to within 2e-5 radians, folded onto |z| <= 1 from the octant.
+// Zero vectors give 0.
+static float fast_atan2f(float y, float x) {
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    float mx = MAX(ax, ay);
+    float z = mx == 0 ? 0 : MIN(ax, ay) / mx;
+    float a = ATAN_POLY(z, z * z);
+    if (ay > ax) a = (float)(M_PI / 2) - a;
+    if (x < 0) a = (float)M_PI - a;
+    return signbit(y) ? -a : a;
+}
+
+// Magnitude and angle of a row of gradients.
+// int fast: use fast_atan2f, VLEN lanes at a time when there is a vector unit.
+static void gradient_polar(const float *gx, const float *gy, float *mag, float *theta, int w, int fast) {
+    int x = 0;
+    if (!fast) {
+        for (; x < w; x++) {
+            mag[x] = sqrtf(gx[x] * gx[x] + gy[x] * gy[x]);
+            theta[x] = atan2f(gy[x], gx[x]);
+        }
+        return;
+    }
+#ifdef VLEN
+    vfloat zero = vset1(0);
+    vfloat sign = vset1(-0.0f);
+    for (; x + VLEN <= w; x += VLEN) {
+        vfloat vx = vload(gx + x);
+        vfloat vy = vload(gy + x);
+        vstore(mag + x, vsqrt(vadd(vmul(vx, vx), vmul(vy, vy))));
+        vfloat ax = vabs(vx);
+        vfloat ay = vabs(vy);
+        vfloat mx = vmax(ax, ay);
+        vfloat z = vselect(vcmpeq(mx, zero), zero, vdiv(vmin(ax, ay), mx));
+        vfloat z2 = vmul(z, z);
+        vfloat a = vmul(z, vadd(vset1(0.9998660f), vmul(z2, vadd(vset1(-0.3302995f),
+                   vmul(z2, vadd(vset1(0.1801410f), vmul(z2, vadd(vset1(-0.0851330f),
+                   vmul(z2, vset1(0.0208351f))))))))));
+        a = vselect(vcmplt(ax, ay), vsub(vset1((float)(M_PI / 2)), a), a);
+        a = vselect(vcmplt(vx, zero), vsub(vset1((float)M_PI), a), a);
+        vstore(theta + x, vxor(a, vand(vy, sign)));
+    }
+#endif
+    for (; x < w; x++) {
+        mag[x] = sqrtf(gx[x] * gx[x] + gy[x] * gy[x]);
+        theta[x] = fast_atan2f(gy[x], gx[x]);
+    }
+}
+
+// Sobel magnitude and angle of every row into channel mc of mag and tc of
+// theta. range: gets min and max of the magnitude, then of the angle.
+static void sobel_rows(image im, int fast, image mag, int mc, image theta, int tc, float range[4]) {
+    int w = im.w;
+    float mmin = INFINITY, mmax = -INFINITY, tmin = INFINITY, tmax = -INFINITY;
+    #pragma omp parallel num_threads(get_image_threads()) reduction(min:mmin, tmin) reduction(max:mmax, tmax)
+    {
+        float *buf = calloc(7 * w, sizeof(float));
+        float *gx = buf, *gy = buf + w, *s = buf + 2 * w, *d = buf + 3 * w;
+        #pragma omp for schedule(static)
         for (int y = 0; y < im.h; y++) {
-            for (int x = 0; x < im.w; x++) {
-                if (range != 0) {
-                    set_pixel(im, x, y, c, (get_pixel(im, x, y, c) - min) / range);
-                } else {
-                    set_pixel(im, x, y, c, 0);
-                }
+            float *m = IMAGE_ROW(mag, y, mc);
+            float *t = IMAGE_ROW(theta, y, tc);
+            sobel_row(im, y, gx, gy, s, d, buf + 4 * w);
+            gradient_polar(gx, gy, m, t, w, fast);
+            for (int x = 0; x < w; x++) {
+                mmin = MIN(mmin, m[x]);
+                mmax = MAX(mmax, m[x]);
+                tmin = MIN(tmin, t[x]);
+                tmax = MAX(tmax, t[x]);
             }
         }
+        free(buf);
     }
+    range[0] = mmin;
+    range[1] = mmax;
+    range[2] = tmin;
+    range[3] = tmax;
 }
 
-image *sobel_image(image im) {
-    image* ret = calloc(2, sizeof(image));
+// Sobel gradient magnitude and angle in one pass over the image.
+// int fast: angles from fast_atan2f instead of atan2f.
+static image *sobel_polar(image im, int fast) {
+    image *ret = calloc(2, sizeof(image));
     ret[0] = make_image(im.w, im.h, 1);
     ret[1] = make_image(im.w, im.h, 1);
-
-    image fgx = make_gx_filter();
-    image fgy = make_gy_filter();
-    image gx = convolve_image(im, fgx, 0);
-    image gy = convolve_image(im, fgy, 0);
-
-    for (int y = 0; y < im.h; y++) {
-        for (int x = 0; x < im.w; x++) {
-            float gx_val = get_pixel(gx, x, y, 0);
-            float gy_val = get_pixel(gy, x, y, 0);
-            set_pixel(ret[0], x, y, 0, sqrtf(gx_val * gx_val + gy_val * gy_val));
-            set_pixel(ret[1], x, y, 0, atan2f(gy_val, gx_val));
-        }
-    }
-    free_image(gx);
-    free_image(gy);
-    free_image(fgx);
-    free_image(fgy);
+    float range[4];
+    sobel_rows(im, fast, ret[0], 0, ret[1], 0, range);
     return ret;
 }
 
-image colorize_sobel(image im) {
-    image *res = sobel_image(im);
-    image mag = res[0];
-    image theta = res[1];
-    feature_normalize(mag);
-    feature_normalize(theta);
+image *sobel_image(image im) {
+    return sobel_polar(im, 0);
+}
 
+// sobel_image with angles good to 2e-5 radians, several times faster.
+image *sobel_image_fast(image im) {
+    return sobel_polar(im, 1);
+}
+
+// Sobel angle as hue and normalized magnitude as saturation and value.
+// Gradients land straight in the output channels, then each row is
+// normalized and converted to rgb while it is still in cache.
+static image colorize_polar(image im, int fast) {
     image ret = make_image(im.w, im.h, 3);
-    for (int y = 0; y < im.h; y++) {
-        for (int x = 0; x < im.w; x++) {
-            set_pixel(ret, x, y, 0, get_pixel(theta, x, y, 0));
-            set_pixel(ret, x, y, 1, get_pixel(mag, x, y, 0));
-            set_pixel(ret, x, y, 2, get_pixel(mag, x, y, 0));
+    float range[4];
+    sobel_rows(im, fast, ret, 1, ret, 0, range);
+    float mrange = range[1] - range[0];
+    float trange = range[3] - range[2];
+    float ms = mrange != 0 ? 1 / mrange : 0;
+    float ts = trange != 0 ? 1 / trange : 0;
+
+    #pragma omp parallel for num_threads(get_image_threads())
+    for (int y = 0; y < ret.h; y++) {
+        float *h = IMAGE_ROW(ret, y, 0);
+        float *sat = IMAGE_ROW(ret, y, 1);
+        float *v = IMAGE_ROW(ret, y, 2);
+        for (int x = 0; x < ret.w; x++) {
+            h[x] = (h[x] - range[2]) * ts;
+            sat[x] = (sat[x] - range[0]) * ms;
+            v[x] = sat[x];
         }
+        image row = ret;
+        row.h = 1;
+        row.data = h;
+        hsv_to_rgb(row);
     }
-    hsv_to_rgb(ret);
     return ret;
 }
 
+image colorize_sobel(image im) {
+    return colorize_polar(im, 0);
+}
+
+image colorize_sobel_fast(image im) {
+    return colorize_polar(im, 1);
+}
+
+
+
+
 
 
 
 
 
 
+#define MAX_BRUSHES 8
 
+// Brushes are alpha masks (only channel 0 is used), decoded once into one
+// buffer. The masks shrunk for a factor are made the first time a factor
+// is asked for and kept, so strokes only rotate.
+typedef struct brush_set {
+    float factor;
+    image brush[MAX_BRUSHES];
+    struct brush_set *next;
+} brush_set;
 
+static float *brush_atlas = 0;
+static image brush_masks[MAX_BRUSHES];
+static brush_set *brush_sets = 0;
+static pthread_mutex_t brush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void load_brush_atlas() {
+    char names[MAX_BRUSHES][32];
+    char *paths[MAX_BRUSHES];
+    for (int i = 0; i < MAX_BRUSHES; i++) {
+        snprintf(names[i], sizeof(names[i]), "brushes/%d.png", i);
+        paths[i] = names[i];
+    }
+    image *ims = load_images(paths, MAX_BRUSHES);
+    size_t total = 0;
+    for (int i = 0; i < MAX_BRUSHES; i++) {
+        total += (size_t)ims[i].w * ims[i].h;
+    }
+    brush_atlas = calloc(total, sizeof(float));
+    float *p = brush_atlas;
+    for (int i = 0; i < MAX_BRUSHES; i++) {
+        image m = {0};
+        m.w = ims[i].w;
+        m.h = ims[i].h;
+        m.c = 1;
+        m.stride = m.w;
+        m.cstride = m.w * m.h;
+        m.format = IMAGE_F32;
+        m.data = p;
+        for (int y = 0; y < m.h; y++) {
+            memcpy(IMAGE_ROW(m, y, 0), IMAGE_ROW(ims[i], y, 0), m.w * sizeof(float));
+        }
+        p += m.cstride;
+        brush_masks[i] = m;
+        free_image(ims[i]);
+    }
+    free(ims);
+}
+
+// The brushes shrunk by factor, shared, don't free them.
+static image *brushes_for(float factor) {
+    pthread_mutex_lock(&brush_lock);
+    if (!brush_atlas) {
+        load_brush_atlas();
+    }
+    brush_set *s = brush_sets;
+    while (s && s->factor != factor) {
+        s = s->next;
+    }
+    if (!s) {
+        s = calloc(1, sizeof(brush_set));
+        s->factor = factor;
+        for (int i = 0; i < MAX_BRUSHES; i++) {
+            image m = brush_masks[i];
+            s->brush[i] = bilinear_resize(m, floor(1.0 * m.w / factor), floor(1.0 * m.h / factor));
+        }
+        s->next = brush_sets;
+        brush_sets = s;
+    }
+    pthread_mutex_unlock(&brush_lock);
+    return s->brush;
+}
 
 image apply_brushes(image base, int resize_index) {
-    int max_brushes = 8;
-    srand(time(NULL));
+    // time alone would give calls running side by side the same strokes
+    thread_srand(time(NULL) ^ (unsigned long long)thread_rand() << 32);
     float factor = 1.0 * 1000 / resize_index;
     if (factor < 4.0) {
         factor = 4.0;
@@ -282,6 +713,7 @@ image apply_brushes(image base, int resize_index) {
     }
     int num = floor(4000 * factor);
     printf("Brush Resize Factor: %f\n", factor);
+    image *brushes = brushes_for(factor);
 
     image temp = make_image(base.w, base.h, base.c);
     image ret = add_image(temp, base);
@@ -289,22 +721,13 @@ image apply_brushes(image base, int resize_index) {
     
     printf("Progress: %d / %d\n", 0, num);
     for (int i = 0; i < num; i++) {
-        int brush_index = rand() % max_brushes;
-        char str0[50] = "brushes/";
-        char str1[10];
-        snprintf(str1, 10, "%d", brush_index);
-        char* str2 = strcat(str0, str1);
-
-        image brush = load_image(strcat(str2, ".png"));
-        image brush_resize = bilinear_resize(brush, floor(1.0 * brush.w / factor), floor(1.0 * brush.h / factor));
-        image brush_rotate = rotate_image(brush_resize, rand() % 360);
+        image brush = brushes[thread_rand() % MAX_BRUSHES];
+        image brush_rotate = rotate_image(brush, thread_rand() % 360);
 
-        int x = rand() % (base.w + 50) - 50;
-        int y = rand() % (base.h + 50) - 50;
+        int x = thread_rand() % (base.w + 50) - 50;
+        int y = thread_rand() % (base.h + 50) - 50;
 
         mix_image(base, ret, brush_rotate, x, y);
-        free_image(brush);
-        free_image(brush_resize);
         free_image(brush_rotate);
 
         if ((i + 1) % 1000 == 0) {
@@ -314,6 +737,22 @@ image apply_brushes(image base, int resize_index) {
     return ret;
 }
 
+typedef struct {
+    image *base, *out;
+    int *resize_index;
+} brush_job;
+
+static void brush_one(int i, void *ctx) {
+    brush_job *j = ctx;
+    j->out[i] = apply_brushes(j->base[i], j->resize_index[i]);
+}
+
+// apply_brushes on n images at once, one thread each.
+void apply_brushes_batch(image *base, int *resize_index, int n, image *out) {
+    brush_job j = {base, out, resize_index};
+    run_batch(n, brush_one, &j);
+}
+
 void mix_image(image base, image to, image brush, int bx, int by) {
     int cx = bx + brush.w / 2;
     int cy = by + brush.h / 2;
@@ -344,10 +783,6 @@ image rotate_image(image origin, int angle) {
  int height = (int) (fabsf(hcos) + fabsf(wsin));
  
  image ret = make_image(width, height, 1);
- 
- for (int i = 0; i < ret.w * ret.h; ++i) {
-    ret.data[i] = 0;
- }
 
  int i, j;
  float rw, rh;
@@ -365,29 +800,42 @@ image rotate_image(image origin, int angle) {
   xshift = 0.0;
   yshift = fabsf(wsin);
  }
+ float ca = cosf(arc);
+ float sa = sinf(arc);
  for (j = 0; j < origin.h; ++j) {
+  float *row = IMAGE_ROW(origin, j, 0);
   for (i = 0; i < origin.w; ++i) {
-   rw = i * cosf(arc) - j * sinf(arc);
-   rh = j * cosf(arc) + i * sinf(arc);
-   set_pixel(ret, rw + xshift, rh + yshift, 0, get_pixel(origin, i, j, 0));
+   rw = i * ca - j * sa;
+   rh = j * ca + i * sa;
+   set_pixel(ret, rw + xshift, rh + yshift, 0, row[i]);
   }
  }
  float v1, v2, v3, v4, v6, v7, v8, v9, val;
  for (j = 0; j < ret.h; ++j) {
+  float *row = IMAGE_ROW(ret, j, 0);
+  int inner = j > 0 && j < ret.h - 1;
   for (i = 0; i < ret.w; ++i) {
-   val = get_pixel(ret, i, j, 0);
-   v1 = get_pixel(ret, i - 1, j - 1, 0);
-   v2 = get_pixel(ret, i, j - 1, 0);
-   v3 = get_pixel(ret, i + 1, j - 1, 0);
-   v4 = get_pixel(ret, i - 1, j, 0);
-   v6 = get_pixel(ret, i + 1, j, 0);
-   v7 = get_pixel(ret, i - 1, j + 1, 0);
-   v8 = get_pixel(ret, i, j + 1, 0);
-   v9 = get_pixel(ret, i + 1, j + 1, 0);
-   if (val == 0) {
-    val = (v1 + v2 + v3 + v4 + v6 + v7 + v8 + v9) / 8;
-    set_pixel(ret, i, j, 0, val);
+   if (row[i] != 0) {
+    continue;
+   }
+   if (inner && i > 0 && i < ret.w - 1) {
+    float *up = row - ret.stride;
+    float *down = row + ret.stride;
+    v1 = up[i - 1]; v2 = up[i]; v3 = up[i + 1];
+    v4 = row[i - 1]; v6 = row[i + 1];
+    v7 = down[i - 1]; v8 = down[i]; v9 = down[i + 1];
+   } else {
+    v1 = get_pixel(ret, i - 1, j - 1, 0);
+    v2 = get_pixel(ret, i, j - 1, 0);
+    v3 = get_pixel(ret, i + 1, j - 1, 0);
+    v4 = get_pixel(ret, i - 1, j, 0);
+    v6 = get_pixel(ret, i + 1, j, 0);
+    v7 = get_pixel(ret, i - 1, j + 1, 0);
+    v8 = get_pixel(ret, i, j + 1, 0);
+    v9 = get_pixel(ret, i + 1, j + 1, 0);
    }
+   val = (v1 + v2 + v3 + v4 + v6 + v7 + v8 + v9) / 8;
+   row[i] = val;
   }
  }
  return ret;
@@ -34,11 +34,14 @@ descriptor describe_index(image im, int i) {
     // If you want you can experiment with other descriptors
     // This subtracts the central value from neighbors
     // to compensate some for exposure/lighting changes.
+    int px = i%im.w;
+    int py = i/im.w;
+    int inside = px >= w/2 && px + w/2 < im.w && py >= w/2 && py + w/2 < im.h;
     for(c = 0; c < im.c; ++c){
-        float cval = im.data[c*im.w*im.h + i];
+        float cval = IMAGE_ROW(im, py, c)[px];
         for(dx = -w/2; dx < (w+1)/2; ++dx){
             for(dy = -w/2; dy < (w+1)/2; ++dy){
-                float val = get_pixel(im, i%im.w+dx, i/im.w+dy, c);
+                float val = inside ? IMAGE_ROW(im, py+dy, c)[px+dx] : get_pixel(im, px+dx, py+dy, c);
                 d.data[count++] = cval - val;
             }
         }
@@ -78,8 +81,17 @@ void mark_corners(image im, descriptor *d, int n) {
 // float sigma: standard deviation of Gaussian.
 // returns: single row image of the filter.
 image make_1d_gaussian(float sigma) {
-    // TODO: optional, make separable 1d Gaussian.
-    return make_image(1,1,1);
+    int w = ceil(sigma * 6);
+    if (w % 2 == 0) {
+        w += 1;
+    }
+    int r = w / 2;
+    image ret = make_image(w, 1, 1);
+    for (int i = -r; i <= r; i++) {
+        ret.data[i + r] = exp(-1.0 * i * i / (2.0 * sigma * sigma));
+    }
+    l1_normalize(ret);
+    return ret;
 }
 
 // Smooths an image using separable Gaussian filter.
@@ -87,16 +99,10 @@ image make_1d_gaussian(float sigma) {
 // float sigma: std dev. for Gaussian.
 // returns: smoothed image.
 image smooth_image(image im, float sigma) {
-    if(1){
-        image g = make_gaussian_filter(sigma);
-        image s = convolve_image(im, g, 1);
-        free_image(g);
-        return s;
-    } else {
-        // TODO: optional, use two convolutions with 1d gaussian filter.
-        // If you implement, disable the above if check.
-        return copy_image(im);
-    }
+    image g = make_1d_gaussian(sigma);
+    image s = convolve_separable(im, g, g, 1);
+    free_image(g);
+    return s;
 }
 
 // Calculate the structure matrix of an image.
@@ -160,22 +166,28 @@ image nms_image(image im, int w) {
     //     for neighbors within w:
     //         if neighbor response greater than pixel response:
     //             set response to be very low (I use -999999 [why not 0??])
+    // Clamped reads near the edges only ever repeat pixels that are already
+    // in the window, so clipping the window gives the same answer.
     for (int y = 0; y < im.h; y++) {
+        int y0 = MAX(y - w, 0);
+        int y1 = MIN(y + w, im.h - 1);
+        float *out = IMAGE_ROW(r, y, 0);
         for (int x = 0; x < im.w; x++) {
-            float center = get_pixel(im, x, y, 0);
-            for (int b = y - w; b <= y + w; b++) {
-                int flag = 0;
-                for (int a = x - w; a <= x + w; a++) {
-                    float curr = get_pixel(im, a, b, 0);
-                    if (curr > center) { 
-                        set_pixel(r, x, y, 0, -1048575);
+            int x0 = MAX(x - w, 0);
+            int x1 = MIN(x + w, im.w - 1);
+            float center = IMAGE_ROW(im, y, 0)[x];
+            int flag = 0;
+            for (int b = y0; b <= y1 && !flag; b++) {
+                float *row = IMAGE_ROW(im, b, 0);
+                for (int a = x0; a <= x1; a++) {
+                    if (row[a] > center) {
                         flag = 1;
                         break;
                     }
                 }
-                if (flag) {
-                    break;
-                }
+            }
+            if (flag) {
+                out[x] = -1048575;
             }
         }
     }
@@ -242,7 +242,7 @@ int model_inliers(matrix H, match *m, int n, float thresh) {
 // int n: number of elements in matches.
 void randomize_matches(match *m, int n) {
     for (int i = 0; i < n; i++) {
-        int j = rand() % n;
+        int j = thread_rand() % n;
         match temp = m[i];
         m[i] = m[j];
         m[j] = temp;
@@ -421,7 +421,7 @@ image combine_images(image a, image b, matrix H) {
 // int iters: number of RANSAC iterations. Typical: 1,000-50,000
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff) {
-    srand(10);
+    thread_srand(10);
     int an = 0;
     int bn = 0;
     int mn = 0;
@@ -453,6 +453,24 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     return comb;
 }
 
+typedef struct {
+    image *a, *b, *out;
+    float sigma, thresh, inlier_thresh;
+    int nms, iters, cutoff;
+} panorama_job;
+
+static void panorama_one(int i, void *ctx) {
+    panorama_job *j = ctx;
+    j->out[i] = panorama_image(j->a[i], j->b[i], j->sigma, j->thresh, j->nms, j->inlier_thresh, j->iters, j->cutoff);
+}
+
+// Stitch n pairs at once, a[i] with b[i] into out[i], one thread each.
+// Parameters as for panorama_image.
+void panorama_images(image *a, image *b, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, image *out) {
+    panorama_job j = {a, b, out, sigma, thresh, inlier_thresh, nms, iters, cutoff};
+    run_batch(n, panorama_one, &j);
+}
+
 // Project an image onto a cylinder.
 // image im: image to project.
 // float f: focal length used to take image (in pixels).
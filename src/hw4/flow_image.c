@@ -60,44 +60,12 @@ image make_integral_image(image im) {
     return integ;
 }
 
-// Apply a box filter to an image using an integral image for speed
+// Apply a box filter to an image with running sums, see box_sum_image
 // image im: image to smooth
 // int s: window size for box filter
-// returns: smoothed image
+// returns: smoothed image, sums of the pixels of each window inside the image
 image box_filter_image(image im, int s) {
-    image integ = make_integral_image(im);
-    image S = make_image(im.w, im.h, im.c);
-    // TD: fill in S using the integral image.
-    for (int c = 0; c < im.c; c++) {
-        for (int y = 0; y < im.h; y++) {
-            int up = y - s / 2;
-            if (up < 0) {
-                up = 0;
-            }
-            int down = y + s / 2;
-            if (down > im.h - 1) {
-                down = im.h - 1;
-            }
-            for (int x = 0; x < im.w; x++) {
-                int left = x - s / 2;
-                if (left < 0) {
-                    left = 0;
-                }
-                int right = x + s / 2;
-                if (right > im.w - 1) {
-                    right = im.w - 1;
-                }
-                float a = get_pixel(integ, right, down, c);
-                float b = get_pixel(integ, left, down, c);
-                float d = get_pixel(integ, right, up, c);
-                float e = get_pixel(integ, left, up, c);
-                float val = a - b - d + e;
-                set_pixel(S, x, y, c, val);
-            }
-        }
-    }
-    free_image(integ);
-    return S;
+    return box_sum_image(im, s, BORDER_ZERO);
 }
 
 // Calculate the time-structure matrix of an image pair.
@@ -146,8 +114,9 @@ image time_structure_matrix(image im, image prev, int s) {
     free_image(gx);
     free_image(gy);
     free_image(gt);
-    box_filter_image(S, s);
-    return box_filter_image(S, s);
+    image ret = box_filter_image(S, s);
+    free_image(S);
+    return ret;
 }
 
 // Calculate the velocity given a structure image
@@ -160,11 +129,11 @@ image velocity_image(image S, int stride) {
     matrix N = make_matrix(2,1);
     for(j = (stride-1)/2; j < S.h; j += stride){
         for(i = (stride-1)/2; i < S.w; i += stride){
-            float Ixx = S.data[i + S.w*j + 0*S.w*S.h];
-            float Iyy = S.data[i + S.w*j + 1*S.w*S.h];
-            float Ixy = S.data[i + S.w*j + 2*S.w*S.h];
-            float Ixt = S.data[i + S.w*j + 3*S.w*S.h];
-            float Iyt = S.data[i + S.w*j + 4*S.w*S.h];
+            float Ixx = IMAGE_ROW(S, j, 0)[i];
+            float Iyy = IMAGE_ROW(S, j, 1)[i];
+            float Ixy = IMAGE_ROW(S, j, 2)[i];
+            float Ixt = IMAGE_ROW(S, j, 3)[i];
+            float Iyt = IMAGE_ROW(S, j, 4)[i];
 
             // TD: calculate vx and vy using the flow equation
             float vx = 0;
@@ -219,10 +188,15 @@ void draw_flow(image im, image v, float scale) {
 // image im: image to constrain
 // float v: each pixel will be in range [-v, v]
 void constrain_image(image im, float v) {
-    int i;
-    for(i = 0; i < im.w*im.h*im.c; ++i){
-        if (im.data[i] < -v) im.data[i] = -v;
-        if (im.data[i] >  v) im.data[i] =  v;
+    int i,j,k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            float *row = IMAGE_ROW(im, j, k);
+            for(i = 0; i < im.w; ++i){
+                if (row[i] < -v) row[i] = -v;
+                if (row[i] >  v) row[i] =  v;
+            }
+        }
     }
 }
 
@@ -251,9 +225,9 @@ void optical_flow_webcam(int smooth, int stride, int div) {
     void * cap;
     cap = open_video_stream(0, 0, 1280, 720, 30);
     image prev = get_image_from_stream(cap);
-    image prev_c = nn_resize(prev, prev.w/div, prev.h/div);
+    image prev_c = downscale_image(prev, div, prev.c == 3);
     image im = get_image_from_stream(cap);
-    image im_c = nn_resize(im, im.w/div, im.h/div);
+    image im_c = downscale_image(im, div, im.c == 3);
     while(im.data){
         image copy = copy_image(im);
         image v = optical_flow_images(im_c, prev_c, smooth, stride);
@@ -271,7 +245,7 @@ void optical_flow_webcam(int smooth, int stride, int div) {
             if (key == 27) break;
         }
         im = get_image_from_stream(cap);
-        im_c = nn_resize(im, im.w/div, im.h/div);
+        im_c = downscale_image(im, div, im.c == 3);
     }
 #else
     fprintf(stderr, "Must compile with OpenCV\n");
@@ -257,6 +257,24 @@ void train_model(model m, data d, int batch, int iters, double rate, double mome
     }
 }
 
+typedef struct {
+    model *m;
+    data *d;
+    int batch, iters;
+    double rate, momentum, decay;
+} train_job;
+
+static void train_one(int i, void *ctx) {
+    train_job *j = ctx;
+    train_model(j->m[i], j->d[i], j->batch, j->iters, j->rate, j->momentum, j->decay);
+}
+
+// Train n models at once, model m[i] on data d[i], one thread each.
+void train_models(model *m, data *d, int n, int batch, int iters, double rate, double momentum, double decay) {
+    train_job j = {m, d, batch, iters, rate, momentum, decay};
+    run_batch(n, train_one, &j);
+}
+
 
 // Questions 
 //
@@ -14,11 +14,31 @@ extern "C" {
 
 // DO NOT CHANGE THIS FILE
 
+// Element formats. u8 and u16 hold [0, 1] scaled to the integer range.
+typedef enum{IMAGE_F32, IMAGE_U8, IMAGE_U16, IMAGE_F16} IMAGE_FORMAT;
+
+// An image is c planes of h rows of w elements, floats unless format says
+// otherwise (data then points at bytes or shorts, see IMAGE_ROW8/16).
+// int stride: elements from the start of one row to the next, >= w.
+// int cstride: elements from the start of one plane to the next, >= stride*h.
+// Images from make_image are packed (stride = w, cstride = w*h), images
+// from make_aligned_image pad rows and planes to IMAGE_ALIGN bytes.
 typedef struct{
     int w,h,c;
     float *data;
+    int stride, cstride;
+    IMAGE_FORMAT format;
 } image;
 
+// Alignment in bytes of rows and planes in aligned images.
+#define IMAGE_ALIGN 64
+
+// Pointer to the start of row y in channel c of an image.
+#define IMAGE_OFFSET(im, y, c) ((size_t)(y)*(im).stride + (size_t)(c)*(im).cstride)
+#define IMAGE_ROW(im, y, c) ((im).data + IMAGE_OFFSET(im, y, c))
+#define IMAGE_ROW8(im, y, c) ((unsigned char *)(im).data + IMAGE_OFFSET(im, y, c))
+#define IMAGE_ROW16(im, y, c) ((unsigned short *)(im).data + IMAGE_OFFSET(im, y, c))
+
 // A 2d point.
 // float x, y: the coordinates of the point.
 typedef struct{
@@ -60,25 +80,132 @@ image get_channel(image im, int c);
 int same_image(image a, image b);
 image sub_image(image a, image b);
 image add_image(image a, image b);
+image hybrid_image(image low, image high, image high_low, float s);
+void shift_scale_clamp_image(image im, float shift, float scale);
+
+// Image memory pool
+// make_image and free_image recycle buffers through a size-bucketed pool.
+typedef struct{
+    size_t requests, hits;
+    size_t bytes_recycled, bytes_cached;
+} image_pool_stats;
+typedef struct image_arena image_arena;
+float *image_pool_alloc(size_t bytes);
+void image_pool_release(float *p, size_t bytes);
+void clear_image_pool();
+void set_image_pool_limit(size_t bytes);
+image_pool_stats get_image_pool_stats();
+void print_image_pool_stats();
+image_arena *make_image_arena();
+image arena_image(image_arena *a, int w, int h, int c);
+void reset_image_arena(image_arena *a);
+void free_image_arena(image_arena *a);
 
+// Reductions
+// argmax is the first pixel holding max, in channel, row, column order.
+typedef struct{
+    float min, max;
+    double sum, sum2;
+    int argmax_x, argmax_y, argmax_c;
+    size_t n;
+} image_stats;
+image_stats reduce_image(image im, int c);
+void shift_scale_image(image im, int c, float shift, float scale);
+
+// Threading
+// Kernels built with OPENMP=1 run on this many threads.
+void set_image_threads(int n);
+int get_image_threads();
+int get_worker_threads();
+void run_batch(int n, void (*f)(int i, void *ctx), void *ctx);
+void thread_srand(unsigned long long seed);
+int thread_rand();
+
+// Element formats
+// get_pixel/set_pixel, copy_image, rgb_to_grayscale, nn_resize,
+// bilinear_resize, convolve_image, mix_image, shift_image, scale_image,
+// clamp_image, rgb_to_hsv, hsv_to_rgb and saving work on every
+// format, other kernels expect IMAGE_F32 (see convert_image).
+image make_image_format(int w, int h, int c, IMAGE_FORMAT f);
+image load_image_format(char *filename, IMAGE_FORMAT f);
+image convert_image(image im, IMAGE_FORMAT f);
+size_t format_size(IMAGE_FORMAT f);
+float half_to_float(unsigned short h);
+unsigned short float_to_half(float f);
+float format_get(image im, int x, int y, int c);
+void format_set(image im, int x, int y, int c, float v);
+void row_to_float(image im, int y, int c, float *out);
+void float_to_row(image im, int y, int c, const float *in);
+
+// Border handling
+typedef enum{BORDER_CLAMP, BORDER_ZERO, BORDER_REFLECT, BORDER_WRAP} BORDER;
+int border_index(int i, int n, BORDER b);
+float get_pixel_border(image im, int x, int y, int c, BORDER b);
+image pad_image(image im, int n, BORDER b);
+image image_interior(image padded, int n);
 
 // Loading and saving
 image make_image(int w, int h, int c);
+image make_aligned_image(int w, int h, int c);
+image make_image_like(image im, int w, int h, int c);
+image align_image(image im);
+image pack_image(image im);
+int is_packed_image(image im);
 image load_image(char *filename);
+image *load_images(char **paths, int n);
+void load_images_each(char **paths, int n, void (*f)(int i, image im, void *ctx), void *ctx);
 void save_image(image im, const char *name);
-void save_image_binary(image im, const char *fname);
-image load_image_binary(const char *fname);
 void save_png(image im, const char *name);
+void save_png_level(image im, const char *name, int level);
+void save_image_quality(image im, const char *name, int quality);
+image load_image_from_memory(const unsigned char *buf, int len);
+unsigned char *encode_image_to_memory(image im, const char *ext, int quality, int *len);
+void free_encoded_image(unsigned char *p);
 void free_image(image im);
 
+// Binary images
+// A 64 byte header, then the planes as laid out in memory from byte 64.
+typedef struct{
+    char magic[4];           // "UWIM"
+    unsigned int version;
+    int format, w, h, c, stride, cstride;
+    unsigned int flags;      // IMAGE_CHECKSUM
+    unsigned int reserved;
+    unsigned long long offset, bytes, checksum;  // payload
+} image_header;
+#define IMAGE_CHECKSUM 1
+#define IMAGE_MAP_WRITE 1
+#define IMAGE_MAP_VERIFY 2
+image_header make_image_header(image im, int flags);
+int read_image_header(FILE *fp, image_header *h);
+void save_image_binary(image im, const char *fname);
+image load_image_binary(const char *fname);
+image map_image_binary(const char *fname, int flags);
+int unmap_image(image im);
+
 // Resizing
+typedef enum{RESIZE_NEAREST, RESIZE_BILINEAR, RESIZE_BICUBIC, RESIZE_LANCZOS3, RESIZE_AREA} RESIZE_FILTER;
+image resize_image(image im, int w, int h, RESIZE_FILTER f);
+image resample_image(image im, int w, int h, RESIZE_FILTER f, int antialias);
+void resample_rows_needed(int in_h, int h, RESIZE_FILTER f, int antialias, int y0, int y1, int *in_y0, int *in_y1);
+image resample_rows(image strip, int in_y0, int in_h, int w, int h, int y0, int y1, RESIZE_FILTER f, int antialias);
 float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+image downscale_image(image im, int f, int gray);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
+image convolve_image_border(image im, image filter, int preserve, BORDER b);
+int separate_filter(image filter, image *row, image *col);
+image convolve_separable(image im, image row, image col, int preserve);
+image convolve_separable_border(image im, image row, image col, int preserve, BORDER b);
+image convolve_fft(image im, image filter, int preserve);
+image convolve_fft_border(image im, image filter, int preserve, BORDER b);
+int use_fft_convolve(image im, image filter, int preserve);
+void clear_fft_cache();
+image make_1d_gaussian(float sigma);
 image make_box_filter(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
@@ -90,8 +217,58 @@ void feature_normalize(image im);
 void l1_normalize(image im);
 void threshold_image(image im, float thresh);
 image *sobel_image(image im);
+image *sobel_image_fast(image im);
 image colorize_sobel(image im);
+image colorize_sobel_fast(image im);
 image smooth_image(image im, float sigma);
+image smooth_image_iir(image im, float sigma);
+float iir_accuracy_report(image im, float sigma);
+image box_sum_image(image im, int s, BORDER b);
+image box_blur_image(image im, int s, BORDER b);
+image smooth_image_box(image im, float sigma, int passes);
+
+// Pyramids
+// Levels are built on first use and owned by the pyramid.
+typedef struct pyramid pyramid;
+image pyramid_down(image im);
+image pyramid_up(image im, int w, int h);
+pyramid *make_pyramid(image im, int levels);
+int pyramid_levels(pyramid *p);
+image pyramid_level(pyramid *p, int i);
+image pyramid_laplacian(pyramid *p, int i);
+image collapse_pyramid(pyramid *p);
+void free_pyramid(pyramid *p);
+
+// Streaming
+// Sources fill strips of rows, sinks take them in order. Stages run
+// strip by strip and hold only the rows their filter reaches.
+typedef struct{
+    int w, h, c;
+    IMAGE_FORMAT format;
+    void *ctx;
+    void (*read)(void *ctx, image strip, int y);  // rows y..y+strip.h
+    void (*close)(void *ctx);
+} image_source;
+typedef struct{
+    void *ctx;
+    void (*write)(void *ctx, image strip, int y);
+    void (*close)(void *ctx);
+} image_sink;
+typedef struct image_stream image_stream;
+image_source open_binary_source(const char *fname);
+image_source open_pnm_source(const char *fname);
+image_source image_source_from_image(image im);
+image_sink open_binary_sink(const char *fname, int w, int h, int c);
+image_sink open_pnm_sink(const char *fname, int w, int h, int c);
+image_sink image_sink_to_image(image im);
+image_stream *make_image_stream(image_source src);
+void stream_shape(image_stream *st, int *w, int *h, int *c, IMAGE_FORMAT *f);
+void stream_map(image_stream *st, void (*f)(image strip, void *ctx), void *ctx);
+void stream_grayscale(image_stream *st);
+void stream_convolve(image_stream *st, image filter, int preserve);
+void stream_smooth(image_stream *st, float sigma);
+void stream_resize(image_stream *st, int w, int h, RESIZE_FILTER f);
+void run_image_stream(image_stream *st, image_sink sink, int strip_rows);
 
 // Harris and Stitching
 point make_point(float x, float y);
@@ -109,8 +286,10 @@ image combine_images(image a, image b, matrix H);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+void panorama_images(image *a, image *b, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, image *out);
 
 // Optical Flow
+image box_filter_image(image im, int s);
 image optical_flow_images(image im, image prev, int smooth, int stride);
 void optical_flow_webcam(int smooth, int stride, int div);
 void draw_flow(image im, image v, float scale);
@@ -118,6 +297,7 @@ void draw_flow(image im, image v, float scale);
 
 
 image apply_brushes(image base, int resize_index);
+void apply_brushes_batch(image *base, int *resize_index, int n, image *out);
 void mix_image(image base, image to, image brush, int bx, int by);
 image rotate_image(image brush, int angle);
 int mean_cluster(image kmean);
@@ -166,6 +346,8 @@ matrix forward_layer(layer *l, matrix in);
 matrix backward_layer(layer *l, matrix delta);
 void update_layer(layer *l, double rate, double momentum, double decay);
 layer make_layer(int input, int output, ACTIVATION activation);
+void train_model(model m, data d, int batch, int iters, double rate, double momentum, double decay);
+void train_models(model *m, data *d, int n, int batch, int iters, double rate, double momentum, double decay);
 matrix load_matrix(const char *fname);
 void save_matrix(matrix m, const char *fname);
 
@@ -0,0 +1,161 @@
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+#include <assert.h>
+#include "image.h"
+
+// Expression templates for pixelwise image math.
+//
+// Wrap images with img() and combine them with + - * /, scalars, clamp, min,
+// max and abs. Nothing is computed until eval() or assign(), which run the
+// whole expression in one pass over memory with a single output image:
+//
+//     image out = eval(clamp(img(a) + (img(b) - img(c)) * s));
+//
+// Every image in an expression must have the same w, h and c. Each node
+// hands out a row object for a given (y, c) so the inner loop over x only
+// touches plain pointers and inlines down to one vectorizable loop.
+
+namespace uwimg {
+
+template <class E>
+struct expr {
+    const E &self() const { return static_cast<const E &>(*this); }
+};
+
+// An image leaf. Rows are read as floats, so only IMAGE_F32 images can be
+// wrapped (see convert_image).
+struct image_expr : expr<image_expr> {
+    image im;
+    explicit image_expr(image im) : im(im) { assert(im.format == IMAGE_F32); }
+    struct row_t {
+        const float *p;
+        float operator[](int x) const { return p[x]; }
+    };
+    row_t row(int y, int c) const { row_t r = {IMAGE_ROW(im, y, c)}; return r; }
+    const image *shape() const { return &im; }
+};
+
+// A constant, broadcast over the image.
+struct scalar_expr : expr<scalar_expr> {
+    float v;
+    explicit scalar_expr(float v) : v(v) {}
+    struct row_t {
+        float v;
+        float operator[](int) const { return v; }
+    };
+    row_t row(int, int) const { row_t r = {v}; return r; }
+    const image *shape() const { return 0; }
+};
+
+template <class Op, class L, class R>
+struct binary_expr : expr<binary_expr<Op, L, R> > {
+    L l;
+    R r;
+    binary_expr(const L &l, const R &r) : l(l), r(r)
+    {
+        const image *a = l.shape();
+        const image *b = r.shape();
+        assert(!a || !b || (a->w == b->w && a->h == b->h && a->c == b->c));
+        (void)a; (void)b;
+    }
+    struct row_t {
+        typename L::row_t l;
+        typename R::row_t r;
+        float operator[](int x) const { return Op::apply(l[x], r[x]); }
+    };
+    row_t row(int y, int c) const { row_t o = {l.row(y, c), r.row(y, c)}; return o; }
+    const image *shape() const { return l.shape() ? l.shape() : r.shape(); }
+};
+
+template <class Op, class E>
+struct unary_expr : expr<unary_expr<Op, E> > {
+    E e;
+    Op op;
+    unary_expr(const E &e, const Op &op) : e(e), op(op) {}
+    struct row_t {
+        typename E::row_t e;
+        Op op;
+        float operator[](int x) const { return op.apply(e[x]); }
+    };
+    row_t row(int y, int c) const { row_t o = {e.row(y, c), op}; return o; }
+    const image *shape() const { return e.shape(); }
+};
+
+struct add_op { static float apply(float a, float b) { return a + b; } };
+struct sub_op { static float apply(float a, float b) { return a - b; } };
+struct mul_op { static float apply(float a, float b) { return a * b; } };
+struct div_op { static float apply(float a, float b) { return a / b; } };
+struct min_op { static float apply(float a, float b) { return a < b ? a : b; } };
+struct max_op { static float apply(float a, float b) { return a > b ? a : b; } };
+struct abs_op { float apply(float a) const { return a < 0 ? -a : a; } };
+struct clamp_op {
+    float lo, hi;
+    float apply(float a) const { return a < lo ? lo : (a > hi ? hi : a); }
+};
+
+inline image_expr img(image im) { return image_expr(im); }
+
+#define UWIMG_BINARY(FN, OP) \
+    template <class A, class B> \
+    inline binary_expr<OP, A, B> FN(const expr<A> &a, const expr<B> &b) \
+    { return binary_expr<OP, A, B>(a.self(), b.self()); } \
+    template <class A> \
+    inline binary_expr<OP, A, scalar_expr> FN(const expr<A> &a, float b) \
+    { return binary_expr<OP, A, scalar_expr>(a.self(), scalar_expr(b)); } \
+    template <class B> \
+    inline binary_expr<OP, scalar_expr, B> FN(float a, const expr<B> &b) \
+    { return binary_expr<OP, scalar_expr, B>(scalar_expr(a), b.self()); }
+
+UWIMG_BINARY(operator+, add_op)
+UWIMG_BINARY(operator-, sub_op)
+UWIMG_BINARY(operator*, mul_op)
+UWIMG_BINARY(operator/, div_op)
+UWIMG_BINARY(min, min_op)
+UWIMG_BINARY(max, max_op)
+#undef UWIMG_BINARY
+
+template <class E>
+inline unary_expr<abs_op, E> abs(const expr<E> &e)
+{
+    return unary_expr<abs_op, E>(e.self(), abs_op());
+}
+
+template <class E>
+inline unary_expr<clamp_op, E> clamp(const expr<E> &e, float lo = 0, float hi = 1)
+{
+    clamp_op op = {lo, hi};
+    return unary_expr<clamp_op, E>(e.self(), op);
+}
+
+// Evaluate an expression into an existing image of the same size.
+// out may be one of the images in the expression.
+template <class E>
+inline void assign(image out, const expr<E> &e)
+{
+    assert(out.format == IMAGE_F32);
+    const E &x = e.self();
+    for (int c = 0; c < out.c; c++) {
+        for (int y = 0; y < out.h; y++) {
+            typename E::row_t r = x.row(y, c);
+            float *o = IMAGE_ROW(out, y, c);
+            for (int i = 0; i < out.w; i++) {
+                o[i] = r[i];
+            }
+        }
+    }
+}
+
+// Evaluate an expression into a new image, laid out like its first image.
+template <class E>
+inline image eval(const expr<E> &e)
+{
+    const image *s = e.self().shape();
+    assert(s);
+    image out = make_image_like(*s, s->w, s->h, s->c);
+    assign(out, e);
+    return out;
+}
+
+}
+
+#endif
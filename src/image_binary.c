@@ -0,0 +1,247 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// Binary images: a 64 byte image_header, then the planes exactly as they
+// sit in memory (rows stride elements apart, planes cstride apart) from
+// byte 64 on. Mapping the file gives an image whose rows are as aligned
+// as the image that was saved, so map_image_binary hands back a pointer
+// into the mapping and loading costs nothing until pages are touched.
+// Files from before the header (w, h, c ints then packed float planes)
+// still load.
+
+#define IMAGE_MAGIC "UWIM"
+#define IMAGE_VERSION 1
+
+typedef char image_header_is_64_bytes[sizeof(image_header) == 64 ? 1 : -1];
+
+// FNV-1a over 8 byte words, the tail byte by byte. Fast enough to run
+// over gigabytes on every load.
+static unsigned long long image_checksum(const unsigned char *p, size_t n, unsigned long long h)
+{
+    const unsigned long long prime = 1099511628211ULL;
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        unsigned long long v;
+        memcpy(&v, p + i, 8);
+        h = (h ^ v)*prime;
+    }
+    for(; i < n; ++i) h = (h ^ p[i])*prime;
+    return h;
+}
+#define CHECKSUM_SEED 14695981039346656037ULL
+
+// Checksum of a payload laid out as h says, chained a row (and a plane's
+// padding) at a time the way save_image_binary writes it.
+static unsigned long long payload_checksum(const unsigned char *p, const image_header *h)
+{
+    size_t size = format_size(h->format);
+    size_t row = (size_t)h->stride*size;
+    size_t gap = ((size_t)h->cstride - (size_t)h->stride*h->h)*size;
+    unsigned long long sum = CHECKSUM_SEED;
+    int j, k;
+    for(k = 0; k < h->c; ++k){
+        for(j = 0; j < h->h; ++j, p += row) sum = image_checksum(p, row, sum);
+        sum = image_checksum(p, gap, sum);
+        p += gap;
+    }
+    return sum;
+}
+
+// Header describing im as save_image_binary lays it out.
+image_header make_image_header(image im, int flags)
+{
+    image_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, 4);
+    h.version = IMAGE_VERSION;
+    h.format = im.format;
+    h.w = im.w;
+    h.h = im.h;
+    h.c = im.c;
+    h.stride = im.stride;
+    h.cstride = im.cstride;
+    h.flags = flags;
+    h.offset = sizeof(image_header);
+    h.bytes = (unsigned long long)im.cstride*im.c*format_size(im.format);
+    return h;
+}
+
+// Whether h describes a layout this version wrote: a known format, rows
+// and planes that don't overlap, and a payload of exactly their size.
+static int valid_image_header(const image_header *h)
+{
+    if(h->version != IMAGE_VERSION && !(h->version == 0 && h->offset == 3*sizeof(int))) return 0;
+    if(h->version == IMAGE_VERSION && h->offset != sizeof(image_header)) return 0;
+    if(h->format < IMAGE_F32 || h->format > IMAGE_F16) return 0;
+    if(h->w < 0 || h->h < 0 || h->c < 0) return 0;
+    if(h->stride < h->w || h->cstride < (long long)h->stride*h->h) return 0;
+    return h->bytes == (unsigned long long)h->cstride*h->c*format_size(h->format);
+}
+
+// Read the header at the start of fp. Headerless files get the header
+// they would have had: version 0, packed floats after 12 bytes.
+// returns: 0 if fp is too short to hold an image or the header doesn't
+//          describe one (see valid_image_header).
+int read_image_header(FILE *fp, image_header *h)
+{
+    memset(h, 0, sizeof(image_header));
+    size_t n = fread(h, 1, sizeof(image_header), fp);
+    if(n >= 4 && !memcmp(h->magic, IMAGE_MAGIC, 4)){
+        return n == sizeof(image_header) && valid_image_header(h);
+    }
+    if(n < 3*sizeof(int)) return 0;
+    int legacy[3];
+    memcpy(legacy, h, sizeof(legacy));
+    memset(h, 0, sizeof(image_header));
+    h->format = IMAGE_F32;
+    h->w = legacy[0];
+    h->h = legacy[1];
+    h->c = legacy[2];
+    h->stride = h->w;
+    h->cstride = (long long)h->w*h->h;  // checked against stride*h below
+    h->offset = 3*sizeof(int);
+    h->bytes = (unsigned long long)h->cstride*h->c*sizeof(float);
+    return valid_image_header(h);
+}
+
+// Save an image with its format and layout, checksummed.
+void save_image_binary(image im, const char *fname)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return;
+    }
+    image_header h = make_image_header(im, IMAGE_CHECKSUM);
+    fwrite(&h, sizeof(h), 1, fp);
+    size_t size = format_size(im.format);
+    size_t row = (size_t)im.stride*size;
+    size_t gap = ((size_t)im.cstride - (size_t)im.stride*im.h)*size;
+    unsigned char *buf = calloc(MAX(row, gap) + 1, 1);
+    unsigned long long sum = CHECKSUM_SEED;
+    int j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            // padding is written as zeros, whatever the image holds there.
+            // the checksum chains the same chunks payload_checksum does
+            memcpy(buf, (char *)im.data + IMAGE_OFFSET(im, j, k)*size, im.w*size);
+            sum = image_checksum(buf, row, sum);
+            fwrite(buf, 1, row, fp);
+        }
+        memset(buf, 0, gap);
+        sum = image_checksum(buf, gap, sum);
+        fwrite(buf, 1, gap, fp);
+    }
+    free(buf);
+    h.checksum = sum;
+    fseeko(fp, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, fp);
+    fclose(fp);
+}
+
+// Live mappings, so free_image can tell them from pooled buffers.
+typedef struct image_mapping{
+    void *base;
+    size_t len;
+    float *data;
+    struct image_mapping *next;
+} image_mapping;
+
+static image_mapping *mappings = 0;
+static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Map a binary image and point an image into the mapping, no copy.
+// int flags: IMAGE_MAP_WRITE maps copy-on-write so the image can be
+//            changed without touching the file, otherwise writing to it
+//            faults. IMAGE_MAP_VERIFY checks the checksum first, which
+//            reads the whole file.
+// returns: the image, in the file's format and layout, empty if the
+//          checksum doesn't match. free_image (or unmap_image) unmaps it.
+image map_image_binary(const char *fname, int flags)
+{
+    image im = {0};
+    int fd = open(fname, O_RDONLY);
+    FILE *fp = fd < 0 ? 0 : fdopen(fd, "rb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        exit(0);
+    }
+    image_header h;
+    struct stat st;
+    if(!read_image_header(fp, &h) || fstat(fd, &st) || h.offset + h.bytes > (unsigned long long)st.st_size){
+        fprintf(stderr, "Bad binary image %s\n", fname);
+        fclose(fp);
+        return im;
+    }
+    size_t len = h.offset + h.bytes;
+    int prot = PROT_READ | (flags & IMAGE_MAP_WRITE ? PROT_WRITE : 0);
+    void *base = mmap(0, len, prot, MAP_PRIVATE, fd, 0);
+    fclose(fp);
+    if(base == MAP_FAILED){
+        fprintf(stderr, "Couldn't map %s\n", fname);
+        return im;
+    }
+    if((flags & IMAGE_MAP_VERIFY) && (h.flags & IMAGE_CHECKSUM) &&
+            payload_checksum((unsigned char *)base + h.offset, &h) != h.checksum){
+        fprintf(stderr, "Checksum mismatch in %s\n", fname);
+        munmap(base, len);
+        return im;
+    }
+    im.w = h.w;
+    im.h = h.h;
+    im.c = h.c;
+    im.stride = h.stride;
+    im.cstride = h.cstride;
+    im.format = h.format;
+    im.data = (float *)((char *)base + h.offset);
+
+    image_mapping *m = calloc(1, sizeof(image_mapping));
+    m->base = base;
+    m->len = len;
+    m->data = im.data;
+    pthread_mutex_lock(&mapping_lock);
+    m->next = mappings;
+    __atomic_store_n(&mappings, m, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mapping_lock);
+    return im;
+}
+
+// Unmap an image from map_image_binary.
+// returns: 0 if im wasn't mapped, and nothing happened.
+int unmap_image(image im)
+{
+    // pooled images are the common case, don't lock for them. The list
+    // head is read atomically, it changes under the lock on other threads
+    if(!im.data || !__atomic_load_n(&mappings, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&mapping_lock);
+    image_mapping **p = &mappings;
+    while(*p && (*p)->data != im.data) p = &(*p)->next;
+    image_mapping *m = *p;
+    if(m) __atomic_store_n(p, m->next, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mapping_lock);
+    if(!m) return 0;
+    munmap(m->base, m->len);
+    free(m);
+    return 1;
+}
+
+// Load a binary image into memory of its own, checking the checksum.
+// Files saved before the header load as IMAGE_F32.
+// returns: the image in the format it was saved in, packed or aligned as
+//          it was saved.
+image load_image_binary(const char *fname)
+{
+    image m = map_image_binary(fname, IMAGE_MAP_VERIFY);
+    if(!m.data) return m;
+    image im = m.stride == m.w && m.cstride == m.w*m.h ? pack_image(m) : align_image(m);
+    unmap_image(m);
+    return im;
+}
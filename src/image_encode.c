@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "simd.h"
+#include "stb_image_write.h"
+
+// PNG and JPEG encoding on several threads. stb does the entropy coding,
+// this file cuts the work into pieces stb can code independently and
+// splices the results into one valid file:
+//
+// PNG: filtered rows are deflated in chunks of about PNG_CHUNK bytes. stb
+// writes each chunk as one fixed Huffman block, so the blocks are joined
+// bit for bit with the final flag cleared on all but the last, and the
+// Adler-32s of the chunks are combined.
+//
+// JPEG: strips of 8 pixel MCU rows are coded separately. Every strip
+// starts with the DC predictions at zero, which is exactly what a restart
+// marker does, so the strips join with RSTn markers under a DRI header.
+
+// in load_image.c with the rest of stb_image_write
+unsigned char *stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
+
+#define PNG_CHUNK (1 << 20)
+#define JPEG_STRIP 16
+
+// Interleave rows [y0, y1) of im into out as 8 bit samples, w*c per row,
+// rounding and clamping floats to [0, 255] on the way.
+static void interleave_rows(image im, unsigned char *out, int y0, int y1)
+{
+    float *row = calloc(im.w, sizeof(float));
+    int x, y, k;
+    for(y = y0; y < y1; ++y){
+        unsigned char *o = out + (size_t)(y - y0)*im.w*im.c;
+        for(k = 0; k < im.c; ++k){
+            if(im.format == IMAGE_U8){
+                const unsigned char *p = IMAGE_ROW8(im, y, k);
+                for(x = 0; x < im.w; ++x) o[x*im.c + k] = p[x];
+                continue;
+            }
+            const float *p = row;
+            if(im.format == IMAGE_F32) p = IMAGE_ROW(im, y, k);
+            else row_to_float(im, y, k, row);
+            x = 0;
+#ifdef VLEN
+            vfloat lo = vset1(.5f), hi = vset1(255.5f), s = vset1(255);
+            float t[VLEN];
+            for(; x + VLEN <= im.w; x += VLEN){
+                vstore(t, vmin(vmax(vadd(vmul(vload(p + x), s), lo), lo), hi));
+                int i;
+                for(i = 0; i < VLEN; ++i) o[(x + i)*im.c + k] = (int)t[i];
+            }
+#endif
+            for(; x < im.w; ++x){
+                float v = 255*p[x] + .5f;
+                o[x*im.c + k] = v < .5f ? 0 : v >= 255 ? 255 : (int)v;
+            }
+        }
+    }
+    free(row);
+}
+
+// im as interleaved 8 bit samples, rows filled in parallel.
+static unsigned char *interleave_u8(image im)
+{
+    unsigned char *out = malloc((size_t)im.w*im.h*im.c);
+    int band = 16;
+    int y;
+    #pragma omp parallel for schedule(static) num_threads(get_image_threads())
+    for(y = 0; y < im.h; y += band) interleave_rows(im, out + (size_t)y*im.w*im.c, y, MIN(y + band, im.h));
+    return out;
+}
+
+static int paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    if(pb <= pc) return b;
+    return c;
+}
+
+// PNG-filter one row of n bytes, bpp bytes per pixel, prev 0 for the
+// first row. Tries all five filters and keeps the one with the smallest
+// sum of absolute signed residuals, the heuristic stb uses too.
+static void filter_row(const unsigned char *row, const unsigned char *prev, int n, int bpp, unsigned char *out, unsigned char *tmp)
+{
+    int best = -1, best_sum = 0;
+    int f, i;
+    for(f = 0; f < 5; ++f){
+        int sum = 0;
+        for(i = 0; i < n; ++i){
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = prev ? prev[i] : 0;
+            int c = i >= bpp && prev ? prev[i - bpp] : 0;
+            int p = f == 0 ? 0 : f == 1 ? a : f == 2 ? b : f == 3 ? (a + b) >> 1 : paeth(a, b, c);
+            tmp[i] = row[i] - p;
+            sum += abs((signed char)tmp[i]);
+        }
+        if(best < 0 || sum < best_sum){
+            best = f;
+            best_sum = sum;
+            memcpy(out + 1, tmp, n);
+        }
+    }
+    out[0] = best;
+}
+
+// Appends bits to a byte buffer, least significant bit first as deflate
+// packs them.
+typedef struct{
+    unsigned char *p;
+    size_t n;
+    unsigned long long acc;
+    int bits;
+} bit_writer;
+
+static void put_bits(bit_writer *w, unsigned v, int n)
+{
+    w->acc |= (unsigned long long)v << w->bits;
+    w->bits += n;
+    while(w->bits >= 8){
+        w->p[w->n++] = w->acc;
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+}
+
+// Copy bits [from, to) of src.
+static void copy_bits(bit_writer *w, const unsigned char *src, size_t from, size_t to)
+{
+    while(from < to && (from & 7)){
+        put_bits(w, src[from >> 3] >> (from & 7) & 1, 1);
+        ++from;
+    }
+    for(; from + 8 <= to; from += 8) put_bits(w, src[from >> 3], 8);
+    if(from < to) put_bits(w, src[from >> 3] & ((1 << (to - from)) - 1), to - from);
+}
+
+static int get_bit(const unsigned char *p, size_t *bit)
+{
+    int b = p[*bit >> 3] >> (*bit & 7) & 1;
+    ++*bit;
+    return b;
+}
+
+// Bit just past the end of block code of the fixed Huffman block that
+// starts at bit (its header included), walking the codes without
+// decoding them.
+static size_t fixed_block_end(const unsigned char *p, size_t bit)
+{
+    static const unsigned char length_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+    static const unsigned char dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+    bit += 3;
+    for(;;){
+        int code = 0, i, sym;
+        for(i = 0; i < 7; ++i) code = code << 1 | get_bit(p, &bit);
+        if(code < 0x18){
+            sym = 256 + code;
+        } else {
+            code = code << 1 | get_bit(p, &bit);
+            if(code < 0xC0) sym = code - 0x30;
+            else if(code < 0xC8) sym = 280 + code - 0xC0;
+            else sym = 144 + (code << 1 | get_bit(p, &bit)) - 0x190;
+        }
+        if(sym == 256) return bit;
+        if(sym > 256){
+            bit += length_extra[sym - 257];
+            int d = 0;
+            for(i = 0; i < 5; ++i) d = d << 1 | get_bit(p, &bit);
+            bit += dist_extra[d];
+        }
+    }
+}
+
+static unsigned adler_combine(unsigned a1, unsigned a2, size_t len2)
+{
+    const unsigned m = 65521;
+    unsigned s1 = a1 & 0xffff, s2 = a1 >> 16;
+    unsigned t1 = a2 & 0xffff, t2 = a2 >> 16;
+    unsigned r = len2 % m;
+    unsigned n1 = (s1 + t1 + m - 1) % m;
+    unsigned n2 = (unsigned)((s2 + t2 + (unsigned long long)r*((s1 + m - 1) % m)) % m);
+    return n2 << 16 | n1;
+}
+
+static unsigned crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table()
+{
+    unsigned n, k;
+    for(n = 0; n < 256; ++n){
+        unsigned c = n;
+        for(k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static unsigned crc32(unsigned crc, const unsigned char *p, size_t n)
+{
+    size_t i;
+    crc = ~crc;
+    for(i = 0; i < n; ++i) crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put32(unsigned char *p, unsigned v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Append a PNG chunk to out at *n.
+static void png_chunk(unsigned char *out, size_t *n, const char *type, const unsigned char *data, size_t len)
+{
+    unsigned char *p = out + *n;
+    put32(p, len);
+    memcpy(p + 4, type, 4);
+    if(len) memcpy(p + 8, data, len);
+    put32(p + 8 + len, crc32(0, p + 4, len + 4));
+    *n += len + 12;
+}
+
+// Whether im has pixels to encode, complains if not.
+static int encodable(image im, int *len)
+{
+    *len = 0;
+    if(im.w > 0 && im.h > 0 && im.c > 0) return 1;
+    fprintf(stderr, "Failed to write image: %d x %d x %d has no pixels\n", im.w, im.h, im.c);
+    return 0;
+}
+
+// Encode im as a PNG in memory.
+// int level: stb's deflate effort, 5 and up, 8 is stb's default.
+// returns: the file bytes, *len of them, free them with free. 0 if im is
+//          empty.
+static unsigned char *encode_png(image im, int level, int *len)
+{
+    static const int color_type[5] = {0, 0, 4, 2, 6};
+    if(!encodable(im, len)) return 0;
+    int c = MIN(im.c, 4);
+    size_t line = (size_t)im.w*c;
+    unsigned char *pix = interleave_u8(im);
+    unsigned char *filt = malloc((line + 1)*im.h);
+    int chunk_rows = MAX(1, PNG_CHUNK/(line + 1));
+    int chunks = (im.h + chunk_rows - 1)/chunk_rows;
+    unsigned char **z = calloc(chunks, sizeof(unsigned char *));
+    int *zlen = calloc(chunks, sizeof(int));
+    int i;
+
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        unsigned char *tmp = malloc(line);
+        int y;
+        #pragma omp for schedule(dynamic)
+        for(i = 0; i < chunks; ++i){
+            int y0 = i*chunk_rows, y1 = MIN(y0 + chunk_rows, im.h);
+            for(y = y0; y < y1; ++y){
+                filter_row(pix + y*line, y ? pix + (y - 1)*line : 0, line, c, filt + y*(line + 1), tmp);
+            }
+            z[i] = stbi_zlib_compress(filt + y0*(line + 1), (y1 - y0)*(line + 1), &zlen[i], level);
+        }
+        free(tmp);
+    }
+    free(pix);
+    free(filt);
+
+    // one zlib stream: stb's header, the chunks' blocks, combined Adler-32
+    size_t total = 0;
+    for(i = 0; i < chunks; ++i) total += zlen[i];
+    bit_writer w = {malloc(total + 16), 0, 0, 0};
+    w.p[w.n++] = z[0][0];
+    w.p[w.n++] = z[0][1];
+    unsigned adler = 1;
+    for(i = 0; i < chunks; ++i){
+        const unsigned char *d = z[i] + 2;
+        size_t end = fixed_block_end(d, 0);
+        put_bits(&w, i == chunks - 1, 1);
+        copy_bits(&w, d, 1, end);
+        const unsigned char *a = z[i] + zlen[i] - 4;
+        unsigned ad = (unsigned)a[0] << 24 | a[1] << 16 | a[2] << 8 | a[3];
+        int y0 = i*chunk_rows, y1 = MIN(y0 + chunk_rows, im.h);
+        adler = i ? adler_combine(adler, ad, (size_t)(y1 - y0)*(line + 1)) : ad;
+        free(z[i]);
+    }
+    if(w.bits) put_bits(&w, 0, 8 - w.bits);
+    put32(w.p + w.n, adler);
+    w.n += 4;
+    free(z);
+    free(zlen);
+
+    pthread_once(&crc_table_once, make_crc_table);
+    size_t idat = 1 << 30;
+    size_t cap = 8 + 25 + 12 + w.n + 12*(w.n/idat + 1);
+    unsigned char *out = malloc(cap);
+    size_t n = 8;
+    memcpy(out, "\x89PNG\r\n\x1a\n", 8);
+    unsigned char ihdr[13] = {0};
+    put32(ihdr, im.w);
+    put32(ihdr + 4, im.h);
+    ihdr[8] = 8;
+    ihdr[9] = color_type[c];
+    png_chunk(out, &n, "IHDR", ihdr, 13);
+    size_t off;
+    for(off = 0; off < w.n; off += idat) png_chunk(out, &n, "IDAT", w.p + off, MIN(idat, w.n - off));
+    png_chunk(out, &n, "IEND", 0, 0);
+    free(w.p);
+    *len = n;
+    return out;
+}
+
+typedef struct{
+    unsigned char *p;
+    size_t n, cap;
+} byte_buffer;
+
+static void buffer_write(void *ctx, void *data, int size)
+{
+    byte_buffer *b = ctx;
+    if(b->n + size > b->cap){
+        b->cap = 2*(b->n + size);
+        b->p = realloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->n, data, size);
+    b->n += size;
+}
+
+// Offset just past the SOS segment of a stb JPEG, where the coded data
+// starts. *sof and *sos are set to where those segments start.
+static size_t jpeg_scan_start(const unsigned char *p, size_t *sof, size_t *sos)
+{
+    size_t i = 2;
+    for(;;){
+        int marker = p[i + 1];
+        size_t seg = p[i + 2] << 8 | p[i + 3];
+        if(marker == 0xC0) *sof = i;
+        if(marker == 0xDA) *sos = i;
+        i += 2 + seg;
+        if(marker == 0xDA) return i;
+    }
+}
+
+// Encode im as a baseline JPEG in memory.
+// int quality: 1 to 100.
+// returns: the file bytes, *len of them, free them with free. 0 if im is
+//          empty.
+static unsigned char *encode_jpg(image im, int quality, int *len)
+{
+    if(!encodable(im, len)) return 0;
+    int c = MIN(im.c, 4);
+    unsigned char *pix = interleave_u8(im);
+    int mcu_cols = (im.w + 7)/8;
+    int mcu_rows = (im.h + 7)/8;
+    // strips of whole MCU rows, the same for any thread count so the file
+    // is too, and short enough to keep the restart interval in 16 bits
+    int strip = MIN(JPEG_STRIP, 65535/MAX(mcu_cols, 1));
+    if(strip < 1) strip = mcu_rows;
+    int strips = (mcu_rows + strip - 1)/strip;
+    byte_buffer *part = calloc(strips, sizeof(byte_buffer));
+    int i;
+    #pragma omp parallel for schedule(dynamic) num_threads(get_image_threads())
+    for(i = 0; i < strips; ++i){
+        int y0 = 8*i*strip, y1 = MIN(y0 + 8*strip, im.h);
+        stbi_write_jpg_to_func(buffer_write, &part[i], im.w, y1 - y0, c, pix + (size_t)y0*im.w*c, quality);
+    }
+    free(pix);
+
+    if(strips == 1){
+        *len = part[0].n;
+        unsigned char *out = part[0].p;
+        free(part);
+        return out;
+    }
+    size_t sof = 0, sos = 0, scan = jpeg_scan_start(part[0].p, &sof, &sos);
+    size_t total = scan + 6;
+    for(i = 0; i < strips; ++i) total += part[i].n;
+    unsigned char *out = malloc(total + 2*strips);
+    // headers up to the scan, with the full height and a DRI before SOS
+    memcpy(out, part[0].p, sos);
+    out[sof + 5] = im.h >> 8;
+    out[sof + 6] = im.h;
+    size_t n = sos;
+    int interval = strip*mcu_cols;
+    unsigned char dri[6] = {0xFF, 0xDD, 0, 4, interval >> 8, interval};
+    memcpy(out + n, dri, 6);
+    n += 6;
+    memcpy(out + n, part[0].p + sos, scan - sos);
+    n += scan - sos;
+    for(i = 0; i < strips; ++i){
+        size_t s0 = i ? jpeg_scan_start(part[i].p, &sof, &sos) : scan;
+        size_t data = part[i].n - 2 - s0;  // without EOI
+        memcpy(out + n, part[i].p + s0, data);
+        n += data;
+        if(i < strips - 1){
+            out[n++] = 0xFF;
+            out[n++] = 0xD0 + i % 8;
+        }
+        free(part[i].p);
+    }
+    out[n++] = 0xFF;
+    out[n++] = 0xD9;
+    free(part);
+    *len = n;
+    return out;
+}
+
+static void write_file(const char *name, const unsigned char *p, int n)
+{
+    FILE *fp = fopen(name, "wb");
+    if(!fp || fwrite(p, 1, n, fp) != (size_t)n) fprintf(stderr, "Failed to write image %s\n", name);
+    if(fp) fclose(fp);
+}
+
+// Save im as name.png.
+// int level: deflate effort, see encode_png.
+void save_png_level(image im, const char *name, int level)
+{
+    char buff[256];
+    int n;
+    snprintf(buff, sizeof(buff), "%s.png", name);
+    unsigned char *p = encode_png(im, level, &n);
+    if(p) write_file(buff, p, n);
+    free(p);
+}
+
+// Save im as name.jpg at a quality from 1 to 100.
+void save_image_quality(image im, const char *name, int quality)
+{
+    char buff[256];
+    int n;
+    snprintf(buff, sizeof(buff), "%s.jpg", name);
+    unsigned char *p = encode_jpg(im, quality, &n);
+    if(p) write_file(buff, p, n);
+    free(p);
+}
+
+// Encode im as an image file in memory instead of saving it.
+// const char *ext: "png" or "jpg".
+// int quality: JPEG quality from 1 to 100, PNGs use stb's usual effort.
+// returns: the file bytes, *len of them, 0 for an unknown ext or an empty
+//          image. Free them with free_encoded_image.
+unsigned char *encode_image_to_memory(image im, const char *ext, int quality, int *len)
+{
+    *len = 0;
+    if(!strcmp(ext, "png")) return encode_png(im, 8, len);
+    if(!strcmp(ext, "jpg") || !strcmp(ext, "jpeg")) return encode_jpg(im, quality, len);
+    fprintf(stderr, "Can't encode images as %s\n", ext);
+    return 0;
+}
+
+void free_encoded_image(unsigned char *p)
+{
+    free(p);
+}
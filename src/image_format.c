@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// Narrow element formats.
+// u8 and u16 store values in [0, 1] scaled to the full integer range,
+// f16 stores IEEE half floats, so loading and saving keep the precision of
+// the file without widening every sample to 4 bytes.
+
+size_t format_size(IMAGE_FORMAT f)
+{
+    switch(f){
+        case IMAGE_U8: return 1;
+        case IMAGE_U16: return 2;
+        case IMAGE_F16: return 2;
+        case IMAGE_F32:
+        default: return 4;
+    }
+}
+
+// IEEE half <-> float, round to nearest even, handles denormals and inf/nan.
+float half_to_float(unsigned short h)
+{
+    unsigned int sign = (h & 0x8000u) << 16;
+    unsigned int exp = (h >> 10) & 0x1f;
+    unsigned int man = h & 0x3ff;
+    unsigned int bits;
+    if(exp == 0x1f){
+        bits = sign | 0x7f800000u | (man << 13);
+    } else if(exp){
+        bits = sign | ((exp + 112) << 23) | (man << 13);
+    } else if(man){
+        // denormal, renormalize
+        exp = 113;
+        while(!(man & 0x400)){
+            man <<= 1;
+            --exp;
+        }
+        bits = sign | (exp << 23) | ((man & 0x3ff) << 13);
+    } else {
+        bits = sign;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+unsigned short float_to_half(float f)
+{
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    unsigned int sign = (bits >> 16) & 0x8000u;
+    int exp = (int)((bits >> 23) & 0xff) - 127 + 15;
+    unsigned int man = bits & 0x7fffffu;
+    if(((bits >> 23) & 0xff) == 0xff){
+        return sign | 0x7c00u | (man ? 0x200u : 0);
+    }
+    if(exp >= 0x1f) return sign | 0x7c00u;
+    if(exp <= 0){
+        if(exp < -10) return sign;
+        man |= 0x800000u;
+        int shift = 14 - exp;
+        unsigned int half = man >> shift;
+        unsigned int rest = man & ((1u << shift) - 1);
+        unsigned int mid = 1u << (shift - 1);
+        if(rest > mid || (rest == mid && (half & 1))) ++half;
+        return sign | half;
+    }
+    unsigned int half = sign | (exp << 10) | (man >> 13);
+    unsigned int rest = man & 0x1fff;
+    // a carry out of the mantissa correctly bumps the exponent
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+    return half;
+}
+
+static unsigned char float_to_u8(float v)
+{
+    if(v <= 0) return 0;
+    if(v >= 1) return 255;
+    return (unsigned char)(v*255 + .5f);
+}
+
+static unsigned short float_to_u16(float v)
+{
+    if(v <= 0) return 0;
+    if(v >= 1) return 65535;
+    return (unsigned short)(v*65535 + .5f);
+}
+
+// Read or write one pixel of any format as a float, no bounds checks.
+float format_get(image im, int x, int y, int c)
+{
+    size_t i = x + (size_t)y*im.stride + (size_t)c*im.cstride;
+    switch(im.format){
+        case IMAGE_U8: return ((unsigned char *)im.data)[i]/255.f;
+        case IMAGE_U16: return ((unsigned short *)im.data)[i]/65535.f;
+        case IMAGE_F16: return half_to_float(((unsigned short *)im.data)[i]);
+        case IMAGE_F32:
+        default: return im.data[i];
+    }
+}
+
+void format_set(image im, int x, int y, int c, float v)
+{
+    size_t i = x + (size_t)y*im.stride + (size_t)c*im.cstride;
+    switch(im.format){
+        case IMAGE_U8: ((unsigned char *)im.data)[i] = float_to_u8(v); break;
+        case IMAGE_U16: ((unsigned short *)im.data)[i] = float_to_u16(v); break;
+        case IMAGE_F16: ((unsigned short *)im.data)[i] = float_to_half(v); break;
+        case IMAGE_F32:
+        default: im.data[i] = v;
+    }
+}
+
+// Widen row y of channel c to floats.
+void row_to_float(image im, int y, int c, float *out)
+{
+    int i = 0;
+    switch(im.format){
+        case IMAGE_U8: {
+            unsigned char *p = IMAGE_ROW8(im, y, c);
+            for(i = 0; i < im.w; ++i) out[i] = p[i]/255.f;
+            break;
+        }
+        case IMAGE_U16: {
+            unsigned short *p = IMAGE_ROW16(im, y, c);
+            for(i = 0; i < im.w; ++i) out[i] = p[i]/65535.f;
+            break;
+        }
+        case IMAGE_F16: {
+            unsigned short *p = IMAGE_ROW16(im, y, c);
+#ifdef __F16C__
+            for(; i + 8 <= im.w; i += 8){
+                _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)(p + i))));
+            }
+#endif
+            for(; i < im.w; ++i) out[i] = half_to_float(p[i]);
+            break;
+        }
+        case IMAGE_F32:
+        default:
+            memcpy(out, IMAGE_ROW(im, y, c), im.w*sizeof(float));
+    }
+}
+
+// Narrow a row of floats into row y of channel c, saturating integer formats.
+void float_to_row(image im, int y, int c, const float *in)
+{
+    int i = 0;
+    switch(im.format){
+        case IMAGE_U8: {
+            unsigned char *p = IMAGE_ROW8(im, y, c);
+            for(i = 0; i < im.w; ++i) p[i] = float_to_u8(in[i]);
+            break;
+        }
+        case IMAGE_U16: {
+            unsigned short *p = IMAGE_ROW16(im, y, c);
+            for(i = 0; i < im.w; ++i) p[i] = float_to_u16(in[i]);
+            break;
+        }
+        case IMAGE_F16: {
+            unsigned short *p = IMAGE_ROW16(im, y, c);
+#ifdef __F16C__
+            for(; i + 8 <= im.w; i += 8){
+                __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+                _mm_storeu_si128((__m128i *)(p + i), h);
+            }
+#endif
+            for(; i < im.w; ++i) p[i] = float_to_half(in[i]);
+            break;
+        }
+        case IMAGE_F32:
+        default:
+            memcpy(IMAGE_ROW(im, y, c), in, im.w*sizeof(float));
+    }
+}
+
+// Copy an image into a new one with a different element format.
+image convert_image(image im, IMAGE_FORMAT f)
+{
+    image out = make_image_format(im.w, im.h, im.c, f);
+    float *row = calloc(im.w, sizeof(float));
+    int j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            row_to_float(im, j, k, row);
+            float_to_row(out, j, k, row);
+        }
+    }
+    free(row);
+    return out;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+
+// Pool of freed image buffers, bucketed by exact (line rounded) size.
+// Pipelines allocate the same few frame sizes over and over, so exact
+// buckets hit almost every time and never waste memory on rounding.
+// Free blocks are kept in a linked list threaded through the blocks.
+
+#define POOL_BUCKETS 64
+
+typedef struct{
+    size_t size;
+    void *head;
+} pool_bucket;
+
+static pool_bucket buckets[POOL_BUCKETS];
+static size_t pool_limit = (size_t)128 << 20;
+static image_pool_stats stats;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t pool_round(size_t bytes)
+{
+    return (bytes + IMAGE_ALIGN - 1)/IMAGE_ALIGN*IMAGE_ALIGN;
+}
+
+// Find the bucket for a size, or claim an empty one if make is set.
+static pool_bucket *find_bucket(size_t size, int make)
+{
+    int i;
+    pool_bucket *empty = 0;
+    for(i = 0; i < POOL_BUCKETS; ++i){
+        if(buckets[i].size == size) return &buckets[i];
+        if(!empty && !buckets[i].head) empty = &buckets[i];
+    }
+    if(make && empty) empty->size = size;
+    return make ? empty : 0;
+}
+
+// Get a zeroed, IMAGE_ALIGN aligned buffer of at least bytes bytes.
+float *image_pool_alloc(size_t bytes)
+{
+    if(!bytes) return 0;
+    size_t size = pool_round(bytes);
+    void *p = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    ++stats.requests;
+    pool_bucket *b = find_bucket(size, 0);
+    if(b && b->head){
+        p = b->head;
+        b->head = *(void **)p;
+        ++stats.hits;
+        stats.bytes_recycled += size;
+        stats.bytes_cached -= size;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if(!p && posix_memalign(&p, IMAGE_ALIGN, size)){
+        fprintf(stderr, "Failed to allocate %zu byte image\n", size);
+        exit(0);
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+// Hand a buffer from image_pool_alloc back, keeping it for reuse if the
+// pool has room and freeing it otherwise.
+void image_pool_release(float *p, size_t bytes)
+{
+    if(!p) return;
+    size_t size = pool_round(bytes);
+    pthread_mutex_lock(&pool_lock);
+    pool_bucket *b = 0;
+    if(stats.bytes_cached + size <= pool_limit) b = find_bucket(size, 1);
+    if(b){
+        *(void **)p = b->head;
+        b->head = p;
+        stats.bytes_cached += size;
+        p = 0;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(p);
+}
+
+// Free every cached buffer.
+void clear_image_pool()
+{
+    int i;
+    pthread_mutex_lock(&pool_lock);
+    for(i = 0; i < POOL_BUCKETS; ++i){
+        while(buckets[i].head){
+            void *p = buckets[i].head;
+            buckets[i].head = *(void **)p;
+            free(p);
+        }
+        buckets[i].size = 0;
+    }
+    stats.bytes_cached = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Cap how many bytes the pool holds on to, 0 turns pooling off.
+void set_image_pool_limit(size_t bytes)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_limit = bytes;
+    int over = stats.bytes_cached > bytes;
+    pthread_mutex_unlock(&pool_lock);
+    if(over) clear_image_pool();
+}
+
+image_pool_stats get_image_pool_stats()
+{
+    pthread_mutex_lock(&pool_lock);
+    image_pool_stats s = stats;
+    pthread_mutex_unlock(&pool_lock);
+    return s;
+}
+
+void print_image_pool_stats()
+{
+    image_pool_stats s = get_image_pool_stats();
+    printf("Image pool: %zu requests, %zu hits (%.1f%%), %.1f MB recycled, %.1f MB cached\n",
+            s.requests, s.hits, s.requests ? 100.*s.hits/s.requests : 0.,
+            s.bytes_recycled/1048576., s.bytes_cached/1048576.);
+}
+
+// Arenas own every image they hand out, and give them all back to the pool
+// at once. Useful for per-frame temporaries in a pipeline.
+struct image_arena{
+    image *images;
+    int n, size;
+};
+
+image_arena *make_image_arena()
+{
+    return calloc(1, sizeof(image_arena));
+}
+
+image arena_image(image_arena *a, int w, int h, int c)
+{
+    if(a->n == a->size){
+        a->size = a->size ? 2*a->size : 16;
+        a->images = realloc(a->images, a->size*sizeof(image));
+    }
+    image im = make_image(w, h, c);
+    a->images[a->n++] = im;
+    return im;
+}
+
+void reset_image_arena(image_arena *a)
+{
+    int i;
+    for(i = 0; i < a->n; ++i){
+        free_image(a->images[i]);
+    }
+    a->n = 0;
+}
+
+void free_image_arena(image_arena *a)
+{
+    reset_image_arena(a);
+    free(a->images);
+    free(a);
+}
@@ -0,0 +1,470 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include "image.h"
+
+// Streaming images through a chain of operations a strip of rows at a
+// time. A source fills strips, each stage asks the stage before it for
+// the rows it needs (its own rows plus the filter radius above and below),
+// keeps the overlap for the next strip and hands back only its own rows,
+// and run_image_stream feeds the last stage's strips to a sink. A stage
+// holds at most strip + 2*radius rows, so memory is bounded by width
+// times filter height instead of the whole frame. Rows by a strip edge
+// see the same neighbors they do in the whole image, so the output
+// matches the full-frame operation.
+
+typedef struct stream_stage stream_stage;
+struct stream_stage{
+    int w, h, c;
+    IMAGE_FORMAT format;
+    // output rows [y0, y1) of this stage, a new image the caller frees.
+    // Stages are always asked for consecutive ranges.
+    image (*rows)(stream_stage *s, int y0, int y1);
+    stream_stage *up;
+
+    // input rows [win_y0, win_y0 + win.h) kept from the last call
+    image win;
+    int win_y0;
+
+    image_source src;
+    int radius, preserve;
+    image filter, col;
+    void (*map)(image strip, void *ctx);
+    void *ctx;
+    RESIZE_FILTER resize;
+};
+
+struct image_stream{
+    stream_stage *last;
+};
+
+// Copy n rows of every channel, from row fy of from to row ty of to.
+static void copy_strip(image to, int ty, image from, int fy, int n)
+{
+    size_t size = format_size(from.format);
+    int j, k;
+    for(k = 0; k < from.c; ++k){
+        for(j = 0; j < n; ++j){
+            memcpy((char *)to.data + IMAGE_OFFSET(to, ty + j, k)*size,
+                    (char *)from.data + IMAGE_OFFSET(from, fy + j, k)*size, from.w*size);
+        }
+    }
+}
+
+// Input rows [y0, y1) of stage s, clamped to the input. Rows the last
+// window already holds are kept, the rest are pulled from upstream.
+// returns: the window, owned by s, row 0 is input row MAX(y0, 0).
+static image stage_input(stream_stage *s, int y0, int y1)
+{
+    stream_stage *u = s->up;
+    y0 = MAX(y0, 0);
+    y1 = MIN(y1, u->h);
+    int have1 = s->win.data ? s->win_y0 + s->win.h : 0;
+    assert(y0 >= s->win_y0 && y1 >= have1);
+    image win = make_image_format(u->w, y1 - y0, u->c, u->format);
+    if(have1 > y0) copy_strip(win, 0, s->win, y0 - s->win_y0, have1 - y0);
+    if(y1 > have1){
+        image fresh = u->rows(u, have1, y1);
+        int from = MAX(y0, have1);
+        copy_strip(win, from - y0, fresh, from - have1, y1 - from);
+        free_image(fresh);
+    }
+    free_image(s->win);
+    s->win = win;
+    s->win_y0 = y0;
+    return win;
+}
+
+static stream_stage *add_stage(image_stream *st, image (*rows)(stream_stage *, int, int))
+{
+    stream_stage *s = calloc(1, sizeof(stream_stage));
+    stream_stage *u = st->last;
+    s->w = u->w;
+    s->h = u->h;
+    s->c = u->c;
+    s->format = u->format;
+    s->rows = rows;
+    s->up = u;
+    st->last = s;
+    return s;
+}
+
+static image source_rows(stream_stage *s, int y0, int y1)
+{
+    image strip = make_image_format(s->w, y1 - y0, s->c, s->format);
+    s->src.read(s->src.ctx, strip, y0);
+    return strip;
+}
+
+// Start a stream reading from src. The stream closes src when it's run.
+image_stream *make_image_stream(image_source src)
+{
+    image_stream *st = calloc(1, sizeof(image_stream));
+    stream_stage *s = calloc(1, sizeof(stream_stage));
+    s->w = src.w;
+    s->h = src.h;
+    s->c = src.c;
+    s->format = src.format;
+    s->src = src;
+    s->rows = source_rows;
+    st->last = s;
+    return st;
+}
+
+// Size and format of what the stream will write out so far.
+void stream_shape(image_stream *st, int *w, int *h, int *c, IMAGE_FORMAT *f)
+{
+    if(w) *w = st->last->w;
+    if(h) *h = st->last->h;
+    if(c) *c = st->last->c;
+    if(f) *f = st->last->format;
+}
+
+static image map_rows(stream_stage *s, int y0, int y1)
+{
+    image strip = s->up->rows(s->up, y0, y1);
+    s->map(strip, s->ctx);
+    return strip;
+}
+
+// Run a point operation on every strip in place, f(strip, ctx).
+void stream_map(image_stream *st, void (*f)(image strip, void *ctx), void *ctx)
+{
+    stream_stage *s = add_stage(st, map_rows);
+    s->map = f;
+    s->ctx = ctx;
+}
+
+static image gray_rows(stream_stage *s, int y0, int y1)
+{
+    image strip = s->up->rows(s->up, y0, y1);
+    image gray = rgb_to_grayscale(strip);
+    free_image(strip);
+    return gray;
+}
+
+// Convert a 3 channel stream to gray, see rgb_to_grayscale.
+void stream_grayscale(image_stream *st)
+{
+    assert(st->last->c == 3);
+    stream_stage *s = add_stage(st, gray_rows);
+    s->c = 1;
+}
+
+static image filter_rows(stream_stage *s, int y0, int y1)
+{
+    image win = stage_input(s, y0 - s->radius, y1 + s->radius);
+    image out = s->col.data ? convolve_separable(win, s->filter, s->col, 1)
+                            : convolve_image(win, s->filter, s->preserve);
+    int from = y0 - s->win_y0;
+    image ret = make_image_like(out, out.w, y1 - y0, out.c);
+    copy_strip(ret, 0, out, from, y1 - y0);
+    free_image(out);
+    return ret;
+}
+
+// convolve_image every strip, reading filter.h/2 rows past it.
+// The stream keeps its own copy of filter.
+void stream_convolve(image_stream *st, image filter, int preserve)
+{
+    stream_stage *s = add_stage(st, filter_rows);
+    s->filter = copy_image(filter);
+    s->preserve = preserve;
+    s->radius = filter.h/2;
+    if(!preserve){
+        // the channel sum of a narrow stream comes out as float, as from
+        // convolve_image
+        s->c = 1;
+        s->format = IMAGE_F32;
+    }
+}
+
+// smooth_image every strip, the 1d Gaussian reaching its radius past it.
+void stream_smooth(image_stream *st, float sigma)
+{
+    stream_stage *s = add_stage(st, filter_rows);
+    s->filter = make_1d_gaussian(sigma);
+    s->col = copy_image(s->filter);
+    s->radius = MAX(s->filter.w, s->filter.h)/2;
+}
+
+static image resize_rows(stream_stage *s, int y0, int y1)
+{
+    int in_y0, in_y1;
+    resample_rows_needed(s->up->h, s->h, s->resize, 1, y0, y1, &in_y0, &in_y1);
+    image win = stage_input(s, in_y0, in_y1);
+    return resample_rows(win, s->win_y0, s->up->h, s->w, s->h, y0, y1, s->resize, 1);
+}
+
+// resize_image the stream to w x h, pulling the input rows each strip
+// of output reads.
+void stream_resize(image_stream *st, int w, int h, RESIZE_FILTER f)
+{
+    stream_stage *s = add_stage(st, resize_rows);
+    s->w = w;
+    s->h = h;
+    s->resize = f;
+}
+
+// Pull the stream through in strips of strip_rows output rows into sink,
+// then close the source and sink and free the stream.
+void run_image_stream(image_stream *st, image_sink sink, int strip_rows)
+{
+    stream_stage *s = st->last;
+    int y;
+    if(strip_rows < 1) strip_rows = 64;
+    for(y = 0; y < s->h; y += strip_rows){
+        image strip = s->rows(s, y, MIN(y + strip_rows, s->h));
+        sink.write(sink.ctx, strip, y);
+        free_image(strip);
+    }
+    while(s){
+        stream_stage *u = s->up;
+        free_image(s->win);
+        free_image(s->filter);
+        free_image(s->col);
+        if(!u && s->src.close) s->src.close(s->src.ctx);
+        free(s);
+        s = u;
+    }
+    if(sink.close) sink.close(sink.ctx);
+    free(st);
+}
+
+// Sources and sinks. Binary files are save_image_binary's, planes of rows
+// after an image_header. PNM files are binary PGM (P5) and PPM (P6), 8 or
+// 16 bit, rows of interleaved samples, the one common format simple
+// enough to read and write a row at a time.
+
+typedef struct{
+    FILE *fp;
+    off_t data;
+    int w, h, c, wide;
+    image_header hdr;
+    unsigned char *buf;
+    image im;
+} stream_file;
+
+static void close_file(void *ctx)
+{
+    stream_file *f = ctx;
+    if(f->fp) fclose(f->fp);
+    free(f->buf);
+    free(f);
+}
+
+static FILE *open_or_die(const char *fname, const char *mode)
+{
+    FILE *fp = fopen(fname, mode);
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        exit(0);
+    }
+    return fp;
+}
+
+static void read_binary(void *ctx, image strip, int y)
+{
+    stream_file *f = ctx;
+    image_header *h = &f->hdr;
+    size_t size = format_size(h->format);
+    // packed files read each plane's part of the strip in one go
+    int rows = h->stride == h->w ? strip.h : 1;
+    int j, k;
+    for(k = 0; k < h->c; ++k){
+        for(j = 0; j < strip.h; j += rows){
+            fseeko(f->fp, h->offset + ((off_t)k*h->cstride + (off_t)(y + j)*h->stride)*size, SEEK_SET);
+            if(fread((char *)strip.data + IMAGE_OFFSET(strip, j, k)*size, size*h->w, rows, f->fp) != (size_t)rows){
+                fprintf(stderr, "Short read in stream at row %d\n", y + j);
+            }
+        }
+    }
+}
+
+// Stream a file written by save_image_binary, in the format it was saved.
+// Checksums aren't checked, strips are read out of file order.
+image_source open_binary_source(const char *fname)
+{
+    stream_file *f = calloc(1, sizeof(stream_file));
+    f->fp = open_or_die(fname, "rb");
+    if(!read_image_header(f->fp, &f->hdr)) fprintf(stderr, "Bad binary image %s\n", fname);
+    image_header *h = &f->hdr;
+    image_source src = {h->w, h->h, h->c, h->format, f, read_binary, close_file};
+    return src;
+}
+
+static void write_binary(void *ctx, image strip, int y)
+{
+    stream_file *f = ctx;
+    float *row = calloc(strip.w, sizeof(float));
+    int j, k;
+    for(k = 0; k < strip.c; ++k){
+        fseeko(f->fp, f->hdr.offset + ((off_t)k*f->h + y)*f->w*sizeof(float), SEEK_SET);
+        for(j = 0; j < strip.h; ++j){
+            row_to_float(strip, j, k, row);
+            fwrite(row, sizeof(float), strip.w, f->fp);
+        }
+    }
+    free(row);
+}
+
+// Write strips of a w x h x c image as a packed IMAGE_F32 binary image,
+// without a checksum since strips land out of file order.
+image_sink open_binary_sink(const char *fname, int w, int h, int c)
+{
+    stream_file *f = calloc(1, sizeof(stream_file));
+    f->fp = open_or_die(fname, "wb");
+    image shape = {w, h, c, 0, w, w*h, IMAGE_F32};
+    f->hdr = make_image_header(shape, 0);
+    fwrite(&f->hdr, sizeof(image_header), 1, f->fp);
+    f->w = w;
+    f->h = h;
+    f->c = c;
+    image_sink sink = {f, write_binary, close_file};
+    return sink;
+}
+
+// Next number in a PNM header, skipping whitespace and # comments.
+static int pnm_int(FILE *fp)
+{
+    int ch = fgetc(fp);
+    while(ch != EOF && (isspace(ch) || ch == '#')){
+        if(ch == '#') while(ch != EOF && ch != '\n') ch = fgetc(fp);
+        ch = fgetc(fp);
+    }
+    int v = 0;
+    while(ch != EOF && isdigit(ch)){
+        v = 10*v + ch - '0';
+        ch = fgetc(fp);
+    }
+    return v;
+}
+
+static void read_pnm(void *ctx, image strip, int y)
+{
+    stream_file *f = ctx;
+    size_t line = (size_t)f->w*f->c*(f->wide ? 2 : 1);
+    int i, j, k;
+    fseeko(f->fp, f->data + (off_t)y*line, SEEK_SET);
+    for(j = 0; j < strip.h; ++j){
+        if(fread(f->buf, 1, line, f->fp) != line){
+            fprintf(stderr, "Short read in stream at row %d\n", y + j);
+        }
+        for(k = 0; k < f->c; ++k){
+            if(f->wide){
+                unsigned short *out = IMAGE_ROW16(strip, j, k);
+                const unsigned char *p = f->buf + 2*k;
+                for(i = 0; i < f->w; ++i) out[i] = p[2*f->c*i] << 8 | p[2*f->c*i + 1];
+            } else {
+                unsigned char *out = IMAGE_ROW8(strip, j, k);
+                const unsigned char *p = f->buf + k;
+                for(i = 0; i < f->w; ++i) out[i] = p[f->c*i];
+            }
+        }
+    }
+}
+
+// Stream a binary PGM or PPM, as IMAGE_U8 strips, or IMAGE_U16 for 16 bit
+// files. Samples are assumed to use the full 8 or 16 bit range.
+image_source open_pnm_source(const char *fname)
+{
+    stream_file *f = calloc(1, sizeof(stream_file));
+    f->fp = open_or_die(fname, "rb");
+    char magic[2] = {0};
+    if(fread(magic, 1, 2, f->fp) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')){
+        fprintf(stderr, "Not a binary PGM or PPM: %s\n", fname);
+        exit(0);
+    }
+    f->c = magic[1] == '6' ? 3 : 1;
+    f->w = pnm_int(f->fp);
+    f->h = pnm_int(f->fp);
+    f->wide = pnm_int(f->fp) > 255;
+    // pnm_int ate the single whitespace byte before the samples
+    f->data = ftello(f->fp);
+    f->buf = calloc((size_t)f->w*f->c, f->wide ? 2 : 1);
+    image_source src = {f->w, f->h, f->c, f->wide ? IMAGE_U16 : IMAGE_U8, f, read_pnm, close_file};
+    return src;
+}
+
+static void write_pnm(void *ctx, image strip, int y)
+{
+    stream_file *f = ctx;
+    size_t line = (size_t)f->w*f->c;
+    float *row = calloc(f->w, sizeof(float));
+    int i, j, k;
+    fseeko(f->fp, f->data + (off_t)y*line, SEEK_SET);
+    for(j = 0; j < strip.h; ++j){
+        for(k = 0; k < f->c; ++k){
+            unsigned char *p = f->buf + k;
+            if(strip.format == IMAGE_U8){
+                const unsigned char *in = IMAGE_ROW8(strip, j, k);
+                for(i = 0; i < f->w; ++i) p[f->c*i] = in[i];
+                continue;
+            }
+            row_to_float(strip, j, k, row);
+            for(i = 0; i < f->w; ++i) p[f->c*i] = roundf(255*MIN(MAX(row[i], 0), 1));
+        }
+        fwrite(f->buf, 1, line, f->fp);
+    }
+    free(row);
+}
+
+// Write strips of a w x h image, 1 or 3 channels, as an 8 bit PGM or PPM.
+image_sink open_pnm_sink(const char *fname, int w, int h, int c)
+{
+    assert(c == 1 || c == 3);
+    stream_file *f = calloc(1, sizeof(stream_file));
+    f->fp = open_or_die(fname, "wb");
+    fprintf(f->fp, "P%d\n%d %d\n255\n", c == 3 ? 6 : 5, w, h);
+    f->data = ftello(f->fp);
+    f->w = w;
+    f->h = h;
+    f->c = c;
+    f->buf = calloc((size_t)w*c, 1);
+    image_sink sink = {f, write_pnm, close_file};
+    return sink;
+}
+
+static void read_memory(void *ctx, image strip, int y)
+{
+    stream_file *f = ctx;
+    copy_strip(strip, 0, f->im, y, strip.h);
+}
+
+// Stream an image already in memory, mostly for testing pipelines.
+// im is borrowed and has to outlive the stream.
+image_source image_source_from_image(image im)
+{
+    stream_file *f = calloc(1, sizeof(stream_file));
+    f->im = im;
+    image_source src = {im.w, im.h, im.c, im.format, f, read_memory, close_file};
+    return src;
+}
+
+static void write_memory(void *ctx, image strip, int y)
+{
+    stream_file *f = ctx;
+    float *row = calloc(strip.w, sizeof(float));
+    int j, k;
+    for(k = 0; k < strip.c; ++k){
+        for(j = 0; j < strip.h; ++j){
+            row_to_float(strip, j, k, row);
+            float_to_row(f->im, y + j, k, row);
+        }
+    }
+    free(row);
+}
+
+// Write strips into im, which must have the stream's size (stream_shape).
+// im's own format is kept.
+image_sink image_sink_to_image(image im)
+{
+    stream_file *f = calloc(1, sizeof(stream_file));
+    f->im = im;
+    image_sink sink = {f, write_memory, close_file};
+    return sink;
+}
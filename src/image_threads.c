@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "image.h"
+
+// Thread count for the parallel kernels. Built without OPENMP=1 every
+// kernel runs on the calling thread and the count stays at 1.
+
+static int image_threads = 0;  // 0: whatever OpenMP would use
+// Set on run_batch workers. The batch already keeps every core busy, so
+// kernels and pools started from it stay on their own thread.
+static __thread int batch_worker = 0;
+
+// Set how many threads parallel kernels use, n <= 0 restores the default
+// (OMP_NUM_THREADS, or one per core).
+void set_image_threads(int n)
+{
+    image_threads = n > 0 ? n : 0;
+}
+
+// Threads the next parallel kernel will run on.
+int get_image_threads()
+{
+    if(batch_worker) return 1;
+#ifdef _OPENMP
+    return image_threads ? image_threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Threads for pthread worker pools, which don't need OpenMP: the count
+// set with set_image_threads, or one per core.
+int get_worker_threads()
+{
+    if(batch_worker) return 1;
+    if(image_threads) return image_threads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+typedef struct{
+    int n, next;
+    void (*f)(int i, void *ctx);
+    void *ctx;
+    pthread_mutex_t lock;
+} batch_queue;
+
+static void *batch_run(void *p)
+{
+    batch_queue *q = p;
+    int outer = batch_worker;
+    batch_worker = 1;
+    for(;;){
+        pthread_mutex_lock(&q->lock);
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if(i >= q->n) break;
+        q->f(i, q->ctx);
+    }
+    batch_worker = outer;
+    return 0;
+}
+
+// Call f(i, ctx) for every i in [0, n) on get_worker_threads() threads,
+// the caller being one of them, and return when all calls have. Each call
+// runs on one thread, see batch_worker.
+void run_batch(int n, void (*f)(int i, void *ctx), void *ctx)
+{
+    batch_queue q = {n, 0, f, ctx};
+    pthread_mutex_init(&q.lock, 0);
+    int threads = MIN(get_worker_threads(), n);
+    pthread_t *pool = calloc(MAX(threads, 1), sizeof(pthread_t));
+    int i;
+    for(i = 1; i < threads; ++i) pthread_create(&pool[i], 0, batch_run, &q);
+    batch_run(&q);
+    for(i = 1; i < threads; ++i) pthread_join(pool[i], 0);
+    free(pool);
+    pthread_mutex_destroy(&q.lock);
+}
+
+// Random numbers with a state per thread, in place of rand(), whose one
+// shared state makes threads wait on each other and scrambles every
+// sequence a thread seeds. A thread that never seeds gets a stream of its
+// own, the same from run to run. splitmix64 underneath.
+static __thread unsigned long long rand_state;
+static __thread int rand_seeded = 0;
+static unsigned long long rand_streams = 0;
+
+void thread_srand(unsigned long long seed)
+{
+    rand_state = seed;
+    rand_seeded = 1;
+}
+
+// returns: a random int in [0, 2^31), like rand() on glibc.
+int thread_rand()
+{
+    if(!rand_seeded) thread_srand(__sync_fetch_and_add(&rand_streams, 1));
+    unsigned long long z = (rand_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    return (int)((z ^ (z >> 31)) >> 33);
+}
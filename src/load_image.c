@@ -1,6 +1,8 @@
 // You probably don't want to edit this file
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "image.h"
 
@@ -11,13 +13,84 @@ image make_empty_image(int w, int h, int c)
     out.h = h;
     out.w = w;
     out.c = c;
+    out.stride = w;
+    out.cstride = w*h;
+    out.format = IMAGE_F32;
+    return out;
+}
+
+image make_image_format(int w, int h, int c, IMAGE_FORMAT f)
+{
+    image out = make_empty_image(w,h,c);
+    out.format = f;
+    out.data = image_pool_alloc((size_t)h*w*c*format_size(f));
     return out;
 }
 
 image make_image(int w, int h, int c)
 {
+    return make_image_format(w, h, c, IMAGE_F32);
+}
+
+// Make an image whose rows and planes all start on IMAGE_ALIGN boundaries.
+// Rows are padded to a whole number of cache lines and planes get one extra
+// line when they would otherwise be a multiple of 4K apart, so the same pixel
+// in different channels doesn't alias in the L1 cache.
+static image make_aligned_image_format(int w, int h, int c, IMAGE_FORMAT f)
+{
+    size_t size = format_size(f);
+    int line = IMAGE_ALIGN/size;
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.format = f;
+    out.stride = (w + line - 1)/line*line;
+    out.cstride = out.stride*h;
+    if ((out.cstride*size) % 4096 == 0) out.cstride += line;
+    out.data = image_pool_alloc((size_t)out.cstride*c*size);
+    return out;
+}
+
+image make_aligned_image(int w, int h, int c)
+{
+    return make_aligned_image_format(w, h, c, IMAGE_F32);
+}
+
+int is_packed_image(image im)
+{
+    return im.stride == im.w && im.cstride == im.w*im.h;
+}
+
+// Make a w x h x c image with the same format and kind of layout as im,
+// so kernels hand back aligned results for aligned inputs.
+image make_image_like(image im, int w, int h, int c)
+{
+    if (is_packed_image(im)) return make_image_format(w, h, c, im.format);
+    return make_aligned_image_format(w, h, c, im.format);
+}
+
+// Copy rows of one image into another of the same size and format.
+static void copy_rows(image to, image from)
+{
+    size_t size = format_size(from.format);
+    int j, k;
+    for(k = 0; k < from.c; ++k){
+        for(j = 0; j < from.h; ++j){
+            memcpy((char *)to.data + IMAGE_OFFSET(to, j, k)*size,
+                    (char *)from.data + IMAGE_OFFSET(from, j, k)*size, from.w*size);
+        }
+    }
+}
+
+image align_image(image im)
+{
+    image out = make_aligned_image_format(im.w, im.h, im.c, im.format);
+    copy_rows(out, im);
+    return out;
+}
+
+image pack_image(image im)
+{
+    image out = make_image_format(im.w, im.h, im.c, im.format);
+    copy_rows(out, im);
     return out;
 }
 
@@ -26,26 +99,11 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+// Save as name.png or name.jpg (quality 100), see image_encode.c.
 void save_image_stb(image im, const char *name, int png)
 {
-    char buff[256];
-    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
-        }
-    }
-    int success = 0;
-    if(png){
-        sprintf(buff, "%s.png", name);
-        success = stbi_write_png(buff, im.w, im.h, im.c, data, im.w*im.c);
-    } else {
-        sprintf(buff, "%s.jpg", name);
-        success = stbi_write_jpg(buff, im.w, im.h, im.c, data, 100);
-    }
-    free(data);
-    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    if(png) save_png_level(im, name, 8);
+    else save_image_quality(im, name, 100);
 }
 
 void save_png(image im, const char *name)
@@ -58,10 +116,66 @@ void save_image(image im, const char *name)
     save_image_stb(im, name, 0);
 }
 
+// Decoded samples go from interleaved to planar in one pass over each
+// row, all planes written as the row is read. 8 bit samples become floats
+// through a table rather than a divide each, with the same values
+// (float)v/255. gives.
+static float u8_to_float[256];
+static pthread_once_t u8_table_once = PTHREAD_ONCE_INIT;
+
+static void make_u8_table()
+{
+    int i;
+    for(i = 0; i < 256; ++i) u8_to_float[i] = (float)i/255.;
+}
+
+#define U8_FLOAT(v) u8_to_float[v]
+#define U8_U16(v) ((v)*257)
+#define U16_FLOAT(v) ((v)/65535.f)
+#define SAME(v) (v)
+
+// Split n interleaved pixels of c samples at src into the first keep
+// planes out[0..keep), converting each sample with CONV. The usual
+// layouts get loops with constant strides.
+#define DEINTERLEAVE(src, c, keep, out, n, CONV) do { \
+    int i_, k_; \
+    if((keep) == 1) for(i_ = 0; i_ < (n); ++i_) (out)[0][i_] = CONV((src)[(c)*i_]); \
+    else if((keep) == 3 && (c) == 3) for(i_ = 0; i_ < (n); ++i_){ \
+        (out)[0][i_] = CONV((src)[3*i_]); \
+        (out)[1][i_] = CONV((src)[3*i_+1]); \
+        (out)[2][i_] = CONV((src)[3*i_+2]); \
+    } else if((keep) == 3 && (c) == 4) for(i_ = 0; i_ < (n); ++i_){ \
+        (out)[0][i_] = CONV((src)[4*i_]); \
+        (out)[1][i_] = CONV((src)[4*i_+1]); \
+        (out)[2][i_] = CONV((src)[4*i_+2]); \
+    } else for(i_ = 0; i_ < (n); ++i_){ \
+        for(k_ = 0; k_ < (keep); ++k_) (out)[k_][i_] = CONV((src)[(c)*i_ + k_]); \
+    } \
+} while(0)
+
+// Planar float image from c interleaved 8 bit samples per pixel, alpha
+// dropped.
+static image image_from_u8(const unsigned char *data, int w, int h, int c)
+{
+    pthread_once(&u8_table_once, make_u8_table);
+    //We don't like alpha channels, #YOLO
+    int keep = c == 4 ? 3 : c;
+    image im = make_image(w, h, keep);
+    int j, k;
+    float *out[4];
+    for(j = 0; j < h; ++j){
+        const unsigned char *src = data + (size_t)c*w*j;
+        for(k = 0; k < keep; ++k) out[k] = IMAGE_ROW(im, j, k);
+        DEINTERLEAVE(src, c, keep, out, w, U8_FLOAT);
+    }
+    return im;
+}
+
 // 
 // Load an image using stb
 // channels = [0..4]
 // channels > 0 forces the image to have that many channels
+// Alpha is dropped, a 4 channel image loads as 3.
 //
 image load_image_stb(char *filename, int channels)
 {
@@ -73,55 +187,86 @@ image load_image_stb(char *filename, int channels)
         exit(0);
     }
     if (channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
-    }
-    //We don't like alpha channels, #YOLO
-    if(im.c == 4) im.c = 3;
+    image im = image_from_u8(data, w, h, c);
     free(data);
     return im;
 }
 
-image load_image(char *filename)
+// Decode an image file held in memory, anything load_image reads.
+// returns: the image as load_image would give it, empty (no data) if buf
+//          isn't an image stb can decode.
+image load_image_from_memory(const unsigned char *buf, int len)
 {
-    image out = load_image_stb(filename, 0);
-    return out;
+    int w, h, c;
+    unsigned char *data = stbi_load_from_memory(buf, len, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot decode image from memory\nSTB Reason: %s\n",
+            stbi_failure_reason());
+        return make_empty_image(0, 0, 0);
+    }
+    image im = image_from_u8(data, w, h, c);
+    free(data);
+    return im;
 }
 
-void save_image_binary(image im, const char *fname)
+// Load an image keeping the decoded precision where the format allows.
+// u8 images keep the 8 bit samples, u16 keeps 16 bit PNGs, f16 and f32
+// widen whatever the file holds. Alpha channels are dropped as in
+// load_image.
+image load_image_format(char *filename, IMAGE_FORMAT f)
 {
-    FILE *fp = fopen(fname, "wb");
-    fwrite(&im.w, sizeof(int), 1, fp);
-    fwrite(&im.h, sizeof(int), 1, fp);
-    fwrite(&im.c, sizeof(int), 1, fp);
-    fwrite(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    fclose(fp);
+    if(f == IMAGE_F32) return load_image(filename);
+    int w, h, c;
+    int wide = f != IMAGE_U8 && stbi_is_16_bit(filename);
+    void *data = wide ? (void *)stbi_load_16(filename, &w, &h, &c, 0)
+                      : (void *)stbi_load(filename, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        exit(0);
+    }
+    pthread_once(&u8_table_once, make_u8_table);
+    int keep = c == 4 ? 3 : c;
+    image im = make_image_format(w, h, keep, f);
+    float *rows = calloc((size_t)keep*w, sizeof(float));
+    float *fout[4];
+    unsigned char *bout[4];
+    unsigned short *sout[4];
+    int j, k;
+    for(j = 0; j < h; ++j){
+        const unsigned char *src8 = (unsigned char *)data + (size_t)c*w*j;
+        const unsigned short *src16 = (unsigned short *)data + (size_t)c*w*j;
+        for(k = 0; k < keep; ++k){
+            fout[k] = rows + k*w;
+            if(f == IMAGE_U8) bout[k] = IMAGE_ROW8(im, j, k);
+            if(f == IMAGE_U16) sout[k] = IMAGE_ROW16(im, j, k);
+        }
+        if(f == IMAGE_U8){
+            DEINTERLEAVE(src8, c, keep, bout, w, SAME);
+        } else if(f == IMAGE_U16 && wide){
+            DEINTERLEAVE(src16, c, keep, sout, w, SAME);
+        } else if(f == IMAGE_U16){
+            DEINTERLEAVE(src8, c, keep, sout, w, U8_U16);
+        } else {
+            if(wide) DEINTERLEAVE(src16, c, keep, fout, w, U16_FLOAT);
+            else DEINTERLEAVE(src8, c, keep, fout, w, U8_FLOAT);
+            for(k = 0; k < keep; ++k) float_to_row(im, j, k, fout[k]);
+        }
+    }
+    free(rows);
+    free(data);
+    return im;
 }
 
-image load_image_binary(const char *fname)
+image load_image(char *filename)
 {
-    int w = 0;
-    int h = 0;
-    int c = 0;
-    FILE *fp = fopen(fname, "rb");
-    fread(&w, sizeof(int), 1, fp);
-    fread(&h, sizeof(int), 1, fp);
-    fread(&c, sizeof(int), 1, fp);
-    image im = make_image(w,h,c);
-    fread(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    return im;
+    image out = load_image_stb(filename, 0);
+    return out;
 }
 
 void free_image(image im)
 {
-    free(im.data);
+    if (unmap_image(im)) return;
+    image_pool_release(im.data, (size_t)im.cstride*im.c*format_size(im.format));
 }
 
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "image.h"
+
+// Decoding many files at once. A pool of workers takes paths in order and
+// decodes them, the calling thread hands the images out in path order.
+// Workers stay at most LOAD_AHEAD images per thread ahead of the caller,
+// so a dataset is never held decoded in memory unless the caller keeps it.
+
+#define LOAD_AHEAD 2
+
+typedef struct{
+    char **paths;
+    int n;
+    int next;       // next path a worker takes
+    int delivered;  // images handed to the caller so far
+    int window;     // images decoded or decoding ahead of the caller
+    image *slot;    // window slots, image i in slot i % window
+    char *ready;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} load_queue;
+
+static void *load_worker(void *arg)
+{
+    load_queue *q = arg;
+    pthread_mutex_lock(&q->lock);
+    for(;;){
+        while(q->next < q->n && q->next - q->delivered >= q->window){
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if(q->next >= q->n) break;
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        image im = load_image(q->paths[i]);
+        pthread_mutex_lock(&q->lock);
+        q->slot[i % q->window] = im;
+        q->ready[i % q->window] = 1;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Decode n files on get_worker_threads() threads and call f(i, im, ctx)
+// for each in path order, on the calling thread. f owns im.
+void load_images_each(char **paths, int n, void (*f)(int i, image im, void *ctx), void *ctx)
+{
+    int threads = MIN(get_worker_threads(), n);
+    if(threads <= 1){
+        int i;
+        for(i = 0; i < n; ++i) f(i, load_image(paths[i]), ctx);
+        return;
+    }
+    load_queue q = {0};
+    q.paths = paths;
+    q.n = n;
+    q.window = LOAD_AHEAD*threads;
+    q.slot = calloc(q.window, sizeof(image));
+    q.ready = calloc(q.window, sizeof(char));
+    pthread_mutex_init(&q.lock, 0);
+    pthread_cond_init(&q.cond, 0);
+    pthread_t *pool = calloc(threads, sizeof(pthread_t));
+    int i;
+    for(i = 0; i < threads; ++i) pthread_create(&pool[i], 0, load_worker, &q);
+
+    for(i = 0; i < n; ++i){
+        int s = i % q.window;
+        pthread_mutex_lock(&q.lock);
+        while(!q.ready[s]) pthread_cond_wait(&q.cond, &q.lock);
+        image im = q.slot[s];
+        q.ready[s] = 0;
+        q.delivered++;
+        pthread_cond_broadcast(&q.cond);
+        pthread_mutex_unlock(&q.lock);
+        f(i, im, ctx);
+    }
+
+    for(i = 0; i < threads; ++i) pthread_join(pool[i], 0);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+    free(pool);
+    free(q.slot);
+    free(q.ready);
+}
+
+static void keep_image(int i, image im, void *ctx)
+{
+    ((image *)ctx)[i] = im;
+}
+
+// Decode n files in parallel, see load_images_each.
+// returns: array of the n images in path order, the caller frees each
+//          image and the array.
+image *load_images(char **paths, int n)
+{
+    image *ims = calloc(n, sizeof(image));
+    load_images_each(paths, n, keep_image, ims);
+    return ims;
+}
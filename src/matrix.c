@@ -1,4 +1,5 @@
 #include "matrix.h"
+#include "image.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -334,7 +335,7 @@ matrix random_matrix(int rows, int cols, double s)
     int i, j;
     for(i = 0; i < rows; ++i){
         for(j = 0; j < cols; ++j){
-            m.data[i][j] = 2*s*(rand()%1000/1000.0) - s;    
+            m.data[i][j] = 2*s*(thread_rand()%1000/1000.0) - s;    
         }
     }
     return m;
@@ -375,7 +376,7 @@ void test_matrix()
 {
     int i;
     for(i = 0; i < 100; ++i){
-        int s = rand()%4 + 3;
+        int s = thread_rand()%4 + 3;
         matrix m = random_matrix(s, s, 10);
         matrix inv = matrix_invert(m);
         matrix res = matrix_mult_matrix(m, inv);
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+
+// Gaussian and Laplacian pyramids after Burt and Adelson, "The Laplacian
+// pyramid as a compact image code" (1983). Each level is the one above
+// blurred with the separable [1 4 6 4 1]/16 kernel and decimated by 2,
+// reading past the edges with BORDER_REFLECT. Levels are built the first
+// time they are asked for and kept, so detectors, flow and stitching
+// working on the same frame share them.
+
+struct pyramid{
+    int levels;
+    image *gauss;  // gauss[0] is the caller's image, the rest are owned
+    image *lap;
+    pthread_mutex_t lock;
+};
+
+static const float PYR_K[5] = {1/16.f, 4/16.f, 6/16.f, 4/16.f, 1/16.f};
+
+// Blur and decimate by 2 in one pass: each output row sums five input rows
+// into a full width row, which is then filtered at the even columns only.
+// image im: any format.
+// returns: float image of (w+1)/2 x (h+1)/2.
+image pyramid_down(image im)
+{
+    int w = (im.w + 1)/2, h = (im.h + 1)/2;
+    image out = make_image(w, h, im.c);
+    int r, n = h*im.c;
+    int *xs = calloc(im.w + 4, sizeof(int));
+    int i;
+    for(i = 0; i < im.w + 4; ++i) xs[i] = border_index(i - 2, im.w, BORDER_REFLECT);
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *tmp = calloc(im.w + 4, sizeof(float));
+        float *row = im.format == IMAGE_F32 ? 0 : calloc(im.w, sizeof(float));
+        int x, j;
+        #pragma omp for schedule(static)
+        for(r = 0; r < n; ++r){
+            int c = r/h, y = r%h;
+            float *t = tmp + 2;
+            memset(t, 0, im.w*sizeof(float));
+            for(j = 0; j < 5; ++j){
+                int sy = border_index(2*y - 2 + j, im.h, BORDER_REFLECT);
+                const float *p = row;
+                if(row) row_to_float(im, sy, c, row);
+                else p = IMAGE_ROW(im, sy, c);
+                float k = PYR_K[j];
+                for(x = 0; x < im.w; ++x) t[x] += k*p[x];
+            }
+            for(x = 0; x < 2; ++x){
+                tmp[x] = t[xs[x]];
+                t[im.w + x] = t[xs[im.w + 2 + x]];
+            }
+            float *o = IMAGE_ROW(out, y, c);
+            for(x = 0; x < w; ++x){
+                const float *q = tmp + 2*x;
+                o[x] = PYR_K[0]*(q[0] + q[4]) + PYR_K[1]*(q[1] + q[3]) + PYR_K[2]*q[2];
+            }
+        }
+        free(tmp);
+        free(row);
+    }
+    free(xs);
+    return out;
+}
+
+// Upsample by 2 with the same kernel, the inverse step of pyramid_down.
+// Even outputs take (1 6 1)/8 of their neighborhood, odd ones (4 4)/8.
+// int w, h: size of the result, 2*im.w - 1 or 2*im.w wide and the same for h.
+// returns: float image of w x h.
+image pyramid_up(image im, int w, int h)
+{
+    image out = make_image(w, h, im.c);
+    int r, n = h*im.c;
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *tmp = calloc(im.w + 2, sizeof(float));
+        float *row = im.format == IMAGE_F32 ? 0 : calloc(im.w, sizeof(float));
+        int x;
+        #pragma omp for schedule(static)
+        for(r = 0; r < n; ++r){
+            int c = r/h, y = r%h;
+            int y0 = y/2;
+            float *t = tmp + 1;
+            // rows of im this output row sees and their weights
+            int ys[3] = {border_index(y0 - 1, im.h, BORDER_REFLECT), y0, border_index(y0 + 1, im.h, BORDER_REFLECT)};
+            float ks[3] = {1/8.f, 6/8.f, 1/8.f};
+            if(y % 2){
+                ys[0] = y0;
+                ys[1] = border_index(y0 + 1, im.h, BORDER_REFLECT);
+                ks[0] = ks[1] = .5f;
+                ks[2] = 0;
+            }
+            memset(t, 0, im.w*sizeof(float));
+            int j;
+            for(j = 0; j < 3; ++j){
+                if(!ks[j]) continue;
+                const float *p = row;
+                if(row) row_to_float(im, ys[j], c, row);
+                else p = IMAGE_ROW(im, ys[j], c);
+                for(x = 0; x < im.w; ++x) t[x] += ks[j]*p[x];
+            }
+            tmp[0] = t[border_index(-1, im.w, BORDER_REFLECT)];
+            t[im.w] = t[border_index(im.w, im.w, BORDER_REFLECT)];
+            float *o = IMAGE_ROW(out, y, c);
+            for(x = 0; x < w; ++x){
+                const float *q = t + x/2;
+                o[x] = x % 2 ? .5f*(q[0] + q[1]) : (q[-1] + 6*q[0] + q[1])/8;
+            }
+        }
+        free(tmp);
+        free(row);
+    }
+    return out;
+}
+
+// Levels a pyramid can hold: halve until the next level would have a side
+// shorter than PYRAMID_MIN, or stop at levels if that comes first.
+#define PYRAMID_MIN 8
+
+static int pyramid_depth(int w, int h, int levels)
+{
+    int n = 1;
+    while((levels <= 0 || n < levels) && MIN((w + 1)/2, (h + 1)/2) >= PYRAMID_MIN){
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+        ++n;
+    }
+    return n;
+}
+
+// Make a pyramid over an image. Nothing is computed until a level is asked
+// for. im is borrowed as level 0 and has to outlive the pyramid.
+// int levels: most levels to build, <= 0 for as many as fit.
+pyramid *make_pyramid(image im, int levels)
+{
+    pyramid *p = calloc(1, sizeof(pyramid));
+    p->levels = pyramid_depth(im.w, im.h, levels);
+    p->gauss = calloc(p->levels, sizeof(image));
+    p->lap = calloc(p->levels, sizeof(image));
+    p->gauss[0] = im;
+    pthread_mutex_init(&p->lock, 0);
+    return p;
+}
+
+int pyramid_levels(pyramid *p)
+{
+    return p->levels;
+}
+
+static image gauss_level(pyramid *p, int i)
+{
+    if(!p->gauss[i].data) p->gauss[i] = pyramid_down(gauss_level(p, i - 1));
+    return p->gauss[i];
+}
+
+// Gaussian level i, about w/2^i x h/2^i, built on first use.
+// The pyramid owns it, don't free it.
+image pyramid_level(pyramid *p, int i)
+{
+    assert(i >= 0 && i < p->levels);
+    pthread_mutex_lock(&p->lock);
+    image g = gauss_level(p, i);
+    pthread_mutex_unlock(&p->lock);
+    return g;
+}
+
+// Laplacian band i: level i minus level i+1 expanded back to its size.
+// The last band is the last Gaussian level, so collapse_pyramid gets back
+// level 0 exactly up to float rounding. The pyramid owns it.
+image pyramid_laplacian(pyramid *p, int i)
+{
+    assert(i >= 0 && i < p->levels);
+    pthread_mutex_lock(&p->lock);
+    if(!p->lap[i].data){
+        image g = gauss_level(p, i);
+        image l = g.format == IMAGE_F32 ? copy_image(g) : convert_image(g, IMAGE_F32);
+        if(i + 1 < p->levels){
+            image up = pyramid_up(gauss_level(p, i + 1), g.w, g.h);
+            int c, y, x;
+            for(c = 0; c < l.c; ++c){
+                for(y = 0; y < l.h; ++y){
+                    float *a = IMAGE_ROW(l, y, c);
+                    float *b = IMAGE_ROW(up, y, c);
+                    for(x = 0; x < l.w; ++x) a[x] -= b[x];
+                }
+            }
+            free_image(up);
+        }
+        p->lap[i] = l;
+    }
+    image l = p->lap[i];
+    pthread_mutex_unlock(&p->lock);
+    return l;
+}
+
+// Rebuild level 0 from the Laplacian bands, coarsest first.
+// returns: a new float image the caller frees.
+image collapse_pyramid(pyramid *p)
+{
+    int i = p->levels - 1;
+    image cur = copy_image(pyramid_laplacian(p, i));
+    for(--i; i >= 0; --i){
+        image l = pyramid_laplacian(p, i);
+        image up = pyramid_up(cur, l.w, l.h);
+        free_image(cur);
+        int c, y, x;
+        for(c = 0; c < l.c; ++c){
+            for(y = 0; y < l.h; ++y){
+                float *a = IMAGE_ROW(up, y, c);
+                float *b = IMAGE_ROW(l, y, c);
+                for(x = 0; x < l.w; ++x) a[x] += b[x];
+            }
+        }
+        cur = up;
+    }
+    return cur;
+}
+
+// Free every level the pyramid built, level 0 stays with the caller.
+void free_pyramid(pyramid *p)
+{
+    int i;
+    for(i = 0; i < p->levels; ++i){
+        if(i > 0) free_image(p->gauss[i]);
+        free_image(p->lap[i]);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p->gauss);
+    free(p->lap);
+    free(p);
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+#include "simd.h"
+
+// Reductions over the pixels of an image. Rows are cut into fixed blocks
+// of REDUCE_ROWS, each block reduces its rows in VLEN lanes, and the block
+// partials are combined in order afterwards, so the result doesn't depend
+// on how many threads ran the blocks.
+
+#define REDUCE_ROWS 16
+
+// Reduce one row of floats into s. The max is the first one in row order.
+static void reduce_row(const float *p, int w, int y, int c, image_stats *s)
+{
+    int x = 0;
+    float mn = INFINITY, mx = -INFINITY, sum = 0, sum2 = 0;
+#ifdef VLEN
+    vfloat vmn = vset1(INFINITY), vmx = vset1(-INFINITY);
+    vfloat vs = vset1(0), vs2 = vset1(0);
+    for(; x + VLEN <= w; x += VLEN){
+        vfloat v = vload(p + x);
+        vmn = vmin(vmn, v);
+        vmx = vmax(vmx, v);
+        vs = vadd(vs, v);
+        vs2 = vadd(vs2, vmul(v, v));
+    }
+    float lanes[4][VLEN];
+    vstore(lanes[0], vmn);
+    vstore(lanes[1], vmx);
+    vstore(lanes[2], vs);
+    vstore(lanes[3], vs2);
+    int i;
+    for(i = 0; i < VLEN; ++i){
+        mn = MIN(mn, lanes[0][i]);
+        mx = MAX(mx, lanes[1][i]);
+        sum += lanes[2][i];
+        sum2 += lanes[3][i];
+    }
+#endif
+    for(; x < w; ++x){
+        mn = MIN(mn, p[x]);
+        mx = MAX(mx, p[x]);
+        sum += p[x];
+        sum2 += p[x]*p[x];
+    }
+    s->min = MIN(s->min, mn);
+    s->sum += sum;
+    s->sum2 += sum2;
+    if(mx > s->max){
+        // only rows that raise the max are scanned for where it is
+        for(x = 0; x < w - 1 && p[x] != mx; ++x);
+        s->max = mx;
+        s->argmax_x = x;
+        s->argmax_y = y;
+        s->argmax_c = c;
+    }
+}
+
+static void init_stats(image_stats *s)
+{
+    memset(s, 0, sizeof(image_stats));
+    s->min = INFINITY;
+    s->max = -INFINITY;
+    s->argmax_x = s->argmax_y = s->argmax_c = -1;
+}
+
+// Min, max, sum, sum of squares and the first max of a channel.
+// image im: image to reduce, any format.
+// int c: channel, or -1 for every channel (argmax then picks the first in
+//        channel, row, column order).
+// returns: the stats, n is the number of pixels reduced.
+image_stats reduce_image(image im, int c)
+{
+    int c0 = c < 0 ? 0 : c;
+    int c1 = c < 0 ? im.c : c + 1;
+    int blocks = (im.h + REDUCE_ROWS - 1)/REDUCE_ROWS;
+    int nb = blocks*(c1 - c0);
+    image_stats *part = calloc(nb > 0 ? nb : 1, sizeof(image_stats));
+    int b;
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *row = im.format == IMAGE_F32 ? 0 : calloc(im.w, sizeof(float));
+        int y;
+        #pragma omp for schedule(static)
+        for(b = 0; b < nb; ++b){
+            int k = c0 + b/blocks;
+            int y0 = b%blocks*REDUCE_ROWS;
+            image_stats *s = &part[b];
+            init_stats(s);
+            for(y = y0; y < MIN(y0 + REDUCE_ROWS, im.h); ++y){
+                const float *p = row;
+                if(row) row_to_float(im, y, k, row);
+                else p = IMAGE_ROW(im, y, k);
+                reduce_row(p, im.w, y, k, s);
+            }
+        }
+        free(row);
+    }
+    image_stats s;
+    init_stats(&s);
+    for(b = 0; b < nb; ++b){
+        s.min = MIN(s.min, part[b].min);
+        s.sum += part[b].sum;
+        s.sum2 += part[b].sum2;
+        if(part[b].max > s.max){
+            s.max = part[b].max;
+            s.argmax_x = part[b].argmax_x;
+            s.argmax_y = part[b].argmax_y;
+            s.argmax_c = part[b].argmax_c;
+        }
+    }
+    s.n = (size_t)im.w*im.h*(c1 - c0);
+    free(part);
+    return s;
+}
+
+// shift_image then scale_image in one pass, v = (v + shift)*scale.
+// Shifting first maps -shift to exactly 0.
+// int c: channel, or -1 for every channel.
+void shift_scale_image(image im, int c, float shift, float scale)
+{
+    int c0 = c < 0 ? 0 : c;
+    int c1 = c < 0 ? im.c : c + 1;
+    int n = im.h*(c1 - c0);
+    int r;
+    #pragma omp parallel num_threads(get_image_threads())
+    {
+        float *row = im.format == IMAGE_F32 ? 0 : calloc(im.w, sizeof(float));
+        int x;
+        #pragma omp for schedule(static)
+        for(r = 0; r < n; ++r){
+            int k = c0 + r/im.h;
+            int y = r%im.h;
+            float *p = row;
+            if(row) row_to_float(im, y, k, row);
+            else p = IMAGE_ROW(im, y, k);
+            for(x = 0; x < im.w; ++x) p[x] = (p[x] + shift)*scale;
+            if(row) float_to_row(im, y, k, row);
+        }
+        free(row);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Thin wrappers over SSE2/AVX2 float vectors so kernels can be written once.
+// VLEN is the number of floats in a vector, and is left undefined when no
+// vector unit is available so kernels fall back to their scalar loops.
+// Build with AVX=1 in the Makefile for 8 wide vectors.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VLEN 8
+typedef __m256 vfloat;
+#define vload(p) _mm256_loadu_ps(p)
+#define vstore(p, a) _mm256_storeu_ps(p, a)
+#define vset1(x) _mm256_set1_ps(x)
+#define vadd(a, b) _mm256_add_ps(a, b)
+#define vsub(a, b) _mm256_sub_ps(a, b)
+#define vmul(a, b) _mm256_mul_ps(a, b)
+#define vdiv(a, b) _mm256_div_ps(a, b)
+#define vmin(a, b) _mm256_min_ps(a, b)
+#define vmax(a, b) _mm256_max_ps(a, b)
+#define vsqrt(a) _mm256_sqrt_ps(a)
+#define vand(a, b) _mm256_and_ps(a, b)
+#define vandnot(a, b) _mm256_andnot_ps(a, b)
+#define vor(a, b) _mm256_or_ps(a, b)
+#define vxor(a, b) _mm256_xor_ps(a, b)
+#define vcmplt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define vcmple(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define vcmpeq(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define vcmpneq(a, b) _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#define vfloor(a) _mm256_floor_ps(a)
+// m ? a : b, m from a comparison
+#define vselect(m, a, b) _mm256_blendv_ps(b, a, m)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VLEN 4
+typedef __m128 vfloat;
+#define vload(p) _mm_loadu_ps(p)
+#define vstore(p, a) _mm_storeu_ps(p, a)
+#define vset1(x) _mm_set1_ps(x)
+#define vadd(a, b) _mm_add_ps(a, b)
+#define vsub(a, b) _mm_sub_ps(a, b)
+#define vmul(a, b) _mm_mul_ps(a, b)
+#define vdiv(a, b) _mm_div_ps(a, b)
+#define vmin(a, b) _mm_min_ps(a, b)
+#define vmax(a, b) _mm_max_ps(a, b)
+#define vsqrt(a) _mm_sqrt_ps(a)
+#define vand(a, b) _mm_and_ps(a, b)
+#define vandnot(a, b) _mm_andnot_ps(a, b)
+#define vor(a, b) _mm_or_ps(a, b)
+#define vxor(a, b) _mm_xor_ps(a, b)
+#define vcmplt(a, b) _mm_cmplt_ps(a, b)
+#define vcmple(a, b) _mm_cmple_ps(a, b)
+#define vcmpeq(a, b) _mm_cmpeq_ps(a, b)
+#define vcmpneq(a, b) _mm_cmpneq_ps(a, b)
+#define vselect(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+// SSE2 has no round instructions, truncate and step down for negatives.
+static inline __m128 vfloor(__m128 a) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1)));
+}
+#endif
+
+#ifdef VLEN
+#define vabs(a) vandnot(vset1(-0.0f), a)
+#endif
+
+#endif
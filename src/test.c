@@ -6,6 +6,7 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "stb_image_write.h"
 
 void feature_normalize2(image im)
 {
@@ -46,16 +47,22 @@ int same_matrix(matrix m, matrix n)
 }
 
 int same_image(image a, image b){
-    int i;
+    int i,j,k;
     if(a.w != b.w || a.h != b.h || a.c != b.c) {
         //printf("Expected %d x %d x %d image, got %d x %d x %d\n", b.w, b.h, b.c, a.w, a.h, a.c);
         return 0;
     }
-    for(i = 0; i < a.w*a.h*a.c; ++i){
-        if(!within_eps(a.data[i], b.data[i])) 
-        {
-            //printf("The value should be %f, but it is %f! \n", b.data[i], a.data[i]);
-            return 0;
+    for(k = 0; k < a.c; ++k){
+        for(j = 0; j < a.h; ++j){
+            float *ra = IMAGE_ROW(a, j, k);
+            float *rb = IMAGE_ROW(b, j, k);
+            for(i = 0; i < a.w; ++i){
+                if(!within_eps(ra[i], rb[i])) 
+                {
+                    //printf("The value should be %f, but it is %f! \n", rb[i], ra[i]);
+                    return 0;
+                }
+            }
         }
     }
     return 1;
@@ -338,17 +345,14 @@ void test_hybrid_image(){
     image f = make_gaussian_filter(2);
     image lfreq_man = convolve_image(man, f, 1);
     image lfreq_w = convolve_image(woman, f, 1);
-    image hfreq_w = sub_image(woman , lfreq_w);
-    image reconstruct = add_image(lfreq_man , hfreq_w);
+    image reconstruct = hybrid_image(lfreq_man, woman, lfreq_w, 1);
     image gt = load_image("figs/hybrid.png");
-    clamp_image(reconstruct);
     TEST(same_image(reconstruct, gt));
     free_image(man);
     free_image(woman);
     free_image(f);
     free_image(lfreq_man);
     free_image(lfreq_w);
-    free_image(hfreq_w);
     free_image(reconstruct);
     free_image(gt);
 }
@@ -443,6 +447,1171 @@ void test_cornerness()
 
 
 
+// Deterministic pseudo-random image for tests that don't need data files.
+image make_test_image(int w, int h, int c, unsigned seed)
+{
+    image im = make_image(w, h, c);
+    int i;
+    for(i = 0; i < w*h*c; ++i){
+        seed = seed*1103515245 + 12345;
+        im.data[i] = ((seed >> 8) & 0xffff) / 65535.;
+    }
+    return im;
+}
+
+void test_aligned_image()
+{
+    image im = make_test_image(37, 23, 3, 1);
+    image a = align_image(im);
+    TEST(((size_t)a.data % IMAGE_ALIGN) == 0);
+    TEST((a.stride*sizeof(float)) % IMAGE_ALIGN == 0);
+    TEST((a.cstride*sizeof(float)) % IMAGE_ALIGN == 0);
+    TEST(!is_packed_image(a) && is_packed_image(im));
+    TEST(same_image(a, im));
+    TEST(within_eps(get_pixel(a, 36, 22, 2), im.data[36 + 22*37 + 2*37*23]));
+
+    image g1 = rgb_to_grayscale(im);
+    image g2 = rgb_to_grayscale(a);
+    TEST(same_image(g1, g2));
+
+    image f = make_gaussian_filter(1);
+    image c1 = convolve_image(im, f, 1);
+    image c2 = convolve_image(a, f, 1);
+    TEST(!is_packed_image(c2));
+    TEST(same_image(c1, c2));
+
+    rgb_to_hsv(im);
+    rgb_to_hsv(a);
+    TEST(same_image(a, im));
+    image p = pack_image(a);
+    TEST(is_packed_image(p) && same_image(p, im));
+
+    free_image(im);
+    free_image(a);
+    free_image(g1);
+    free_image(g2);
+    free_image(f);
+    free_image(c1);
+    free_image(c2);
+    free_image(p);
+}
+
+// Straightforward convolution to check the optimized paths against.
+image convolve_reference(image im, image f, int preserve, BORDER b)
+{
+    image out = make_image(im.w, im.h, preserve ? im.c : 1);
+    int x, y, c, i, j;
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x){
+            float total = 0;
+            for(c = 0; c < im.c; ++c){
+                float sum = 0;
+                for(j = 0; j < f.h; ++j){
+                    for(i = 0; i < f.w; ++i){
+                        sum += get_pixel_border(im, x - f.w/2 + i, y - f.h/2 + j, c, b)
+                            * get_pixel(f, i, j, f.c == 1 ? 0 : c);
+                    }
+                }
+                if(preserve) set_pixel(out, x, y, c, sum);
+                total += sum;
+            }
+            if(!preserve) set_pixel(out, x, y, 0, total);
+        }
+    }
+    return out;
+}
+
+void test_border()
+{
+    TEST(border_index(-1, 5, BORDER_CLAMP) == 0);
+    TEST(border_index(7, 5, BORDER_CLAMP) == 4);
+    TEST(border_index(-1, 5, BORDER_ZERO) == -1);
+    TEST(border_index(-1, 5, BORDER_REFLECT) == 0);
+    TEST(border_index(-2, 5, BORDER_REFLECT) == 1);
+    TEST(border_index(6, 5, BORDER_REFLECT) == 3);
+    TEST(border_index(-1, 5, BORDER_WRAP) == 4);
+    TEST(border_index(11, 5, BORDER_WRAP) == 1);
+
+    image im = make_test_image(19, 11, 3, 2);
+    image p = pad_image(im, 3, BORDER_REFLECT);
+    image v = image_interior(p, 3);
+    TEST(same_image(v, im));
+    TEST(within_eps(IMAGE_ROW(v, -2, 1)[-3], get_pixel(im, 2, 1, 1)));
+    free_image(p);
+
+    image f = make_emboss_filter();
+    image g = make_gaussian_filter(2);
+    BORDER b;
+    for(b = BORDER_CLAMP; b <= BORDER_WRAP; ++b){
+        image r1 = convolve_reference(im, f, 1, b);
+        image c1 = convolve_image_border(im, f, 1, b);
+        image r2 = convolve_reference(im, g, 0, b);
+        image c2 = convolve_image_border(im, g, 0, b);
+        TEST(same_image(r1, c1));
+        TEST(same_image(r2, c2));
+        free_image(r1);
+        free_image(c1);
+        free_image(r2);
+        free_image(c2);
+    }
+    free_image(im);
+    free_image(f);
+    free_image(g);
+}
+
+void test_image_pool()
+{
+    image_pool_stats before = get_image_pool_stats();
+    image a = make_image(33, 17, 3);
+    free_image(a);
+    image b = make_image(33, 17, 3);
+    image_pool_stats after = get_image_pool_stats();
+    TEST(after.requests - before.requests == 2);
+    TEST(after.hits - before.hits == 1);
+    TEST(after.bytes_recycled > before.bytes_recycled);
+    TEST(b.data == a.data);
+    TEST(((size_t)b.data % IMAGE_ALIGN) == 0);
+    int i, zero = 1;
+    for(i = 0; i < b.w*b.h*b.c; ++i) zero = zero && b.data[i] == 0;
+    TEST(zero);
+    free_image(b);
+
+    image_arena *arena = make_image_arena();
+    image t = arena_image(arena, 64, 64, 1);
+    arena_image(arena, 8, 8, 3);
+    reset_image_arena(arena);
+    image u = arena_image(arena, 64, 64, 1);
+    TEST(u.data == t.data);
+    free_image_arena(arena);
+
+    set_image_pool_limit(0);
+    TEST(get_image_pool_stats().bytes_cached == 0);
+    set_image_pool_limit((size_t)128 << 20);
+}
+
+// Largest absolute difference between two images of the same size.
+float max_diff(image a, image b)
+{
+    float m = 0;
+    int i,j,k;
+    for(k = 0; k < a.c; ++k){
+        for(j = 0; j < a.h; ++j){
+            for(i = 0; i < a.w; ++i){
+                m = MAX(m, fabsf(get_pixel(a, i, j, k) - get_pixel(b, i, j, k)));
+            }
+        }
+    }
+    return m;
+}
+
+// Swap x and y, a 1 pixel wide image runs every pixel through the scalar
+// tail of the vector kernels.
+image transpose_image(image im)
+{
+    image t = make_image(im.h, im.w, im.c);
+    int i,j,k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            for(i = 0; i < im.w; ++i){
+                set_pixel(t, j, i, k, get_pixel(im, i, j, k));
+            }
+        }
+    }
+    return t;
+}
+
+void test_color_simd()
+{
+    image im = make_test_image(67, 1, 3, 3);
+    // Grays, black, ties for the max and hues on sector edges.
+    float edge[][3] = {{.5,.5,.5}, {0,0,0}, {1,1,0}, {0,1,1}, {1,0,1}, {.2,.7,.7},
+        {1,0,0}, {1,.5,0}, {0,1,0}, {0,0,1}, {1,0,.001}, {.999,1,0}};
+    int i, k;
+    for(i = 0; i < 12; ++i){
+        for(k = 0; k < 3; ++k) set_pixel(im, i, 0, k, edge[i][k]);
+    }
+    image t = transpose_image(im);
+
+    image g = rgb_to_grayscale(im);
+    image gt = rgb_to_grayscale(t);
+    image gtt = transpose_image(gt);
+    TEST(max_diff(g, gtt) < 1e-6);
+
+    rgb_to_hsv(im);
+    rgb_to_hsv(t);
+    image tt = transpose_image(t);
+    TEST(max_diff(im, tt) < 1e-6);
+    free_image(tt);
+
+    hsv_to_rgb(im);
+    hsv_to_rgb(t);
+    tt = transpose_image(t);
+    TEST(max_diff(im, tt) < 1e-6);
+
+    free_image(im);
+    free_image(t);
+    free_image(tt);
+    free_image(g);
+    free_image(gt);
+    free_image(gtt);
+}
+
+void test_fused_hybrid()
+{
+    image low = make_test_image(45, 13, 3, 4);
+    image high = make_test_image(45, 13, 3, 5);
+    image blur = make_test_image(45, 13, 3, 6);
+    image h = hybrid_image(low, high, blur, 1);
+    image d = sub_image(high, blur);
+    image gt = add_image(low, d);
+    clamp_image(gt);
+    TEST(same_image(h, gt));
+    // shift, scale and clamp in one pass, as the three calls give
+    image a = copy_image(high);
+    image b = copy_image(high);
+    int c;
+    for(c = 0; c < a.c; ++c){
+        shift_image(a, c, -.3);
+        scale_image(a, c, 1.7);
+    }
+    clamp_image(a);
+    shift_scale_clamp_image(b, -.3, 1.7);
+    TEST(same_image(a, b) && max_diff(a, b) < 1e-6);
+    free_image(a);
+    free_image(b);
+
+    // narrow inputs are widened, the result comes back in low's format
+    image n = convert_image(low, IMAGE_U8);
+    image hn = hybrid_image(n, high, blur, 1);
+    image gn = convert_image(n, IMAGE_F32);
+    image ref = hybrid_image(gn, high, blur, 1);
+    image rn = convert_image(ref, IMAGE_U8);
+    TEST(hn.format == IMAGE_U8 && max_diff(hn, rn) == 0);
+    free_image(n);
+    free_image(hn);
+    free_image(gn);
+    free_image(ref);
+    free_image(rn);
+    free_image(h);
+    free_image(d);
+    free_image(gt);
+    free_image(low);
+    free_image(high);
+    free_image(blur);
+}
+
+void test_formats()
+{
+    TEST(half_to_float(float_to_half(1.5f)) == 1.5f);
+    TEST(half_to_float(float_to_half(-0.0009765625f)) == -0.0009765625f);
+    TEST(half_to_float(float_to_half(65504.f)) == 65504.f);
+    TEST(half_to_float(float_to_half(5.96046448e-8f)) == 5.96046448e-8f);
+    TEST(float_to_half(1.0f + 1/4096.f) == float_to_half(1.0f));
+
+    image im = make_test_image(41, 19, 3, 7);
+    IMAGE_FORMAT f;
+    for(f = IMAGE_U8; f <= IMAGE_F16; ++f){
+        float tol = f == IMAGE_U8 ? .5/255 + 1e-6 : f == IMAGE_U16 ? .5/65535 + 1e-6 : 1/2048.;
+        image n = convert_image(im, f);
+        image back = convert_image(n, IMAGE_F32);
+        TEST(max_diff(back, im) <= tol);
+        TEST(within_eps(get_pixel(n, 40, 18, 2), get_pixel(im, 40, 18, 2)));
+
+        // Kernels on narrow images track the float ones to within a step.
+        image g = rgb_to_grayscale(n);
+        image gf = rgb_to_grayscale(back);
+        TEST(g.format == f && max_diff(g, gf) <= 2*tol + 1e-6);
+
+        image r = bilinear_resize(n, 60, 11);
+        image rf = bilinear_resize(back, 60, 11);
+        TEST(r.format == f && max_diff(r, rf) <= tol + 1e-6);
+
+        image k = make_gaussian_filter(1);
+        image c = convolve_image(n, k, 1);
+        image cf = convolve_image(back, k, 1);
+        TEST(c.format == f && max_diff(c, cf) <= tol + 1e-6);
+        image c0 = convolve_image(n, k, 0);
+        image cf0 = convolve_image(back, k, 0);
+        TEST(c0.format == IMAGE_F32 && max_diff(c0, cf0) < 1e-5);
+
+        image h = copy_image(n);
+        image hf = copy_image(back);
+        rgb_to_hsv(h);
+        rgb_to_hsv(hf);
+        TEST(h.format == f && max_diff(h, hf) <= tol + 1e-6);
+        hsv_to_rgb(h);
+        hsv_to_rgb(hf);
+        TEST(max_diff(h, hf) <= 8*tol);
+
+        image s = copy_image(n);
+        image sf = copy_image(back);
+        int k2;
+        for(k2 = 0; k2 < 3; ++k2){
+            shift_image(s, k2, -.2);
+            scale_image(s, k2, 1.5);
+            shift_image(sf, k2, -.2);
+            scale_image(sf, k2, 1.5);
+        }
+        clamp_image(s);
+        clamp_image(sf);
+        TEST(s.format == f && max_diff(s, sf) <= 3*tol);
+
+        free_image(h);
+        free_image(hf);
+        free_image(s);
+        free_image(sf);
+        free_image(n);
+        free_image(back);
+        free_image(g);
+        free_image(gf);
+        free_image(r);
+        free_image(rf);
+        free_image(k);
+        free_image(c);
+        free_image(cf);
+        free_image(c0);
+        free_image(cf0);
+    }
+    free_image(im);
+
+    image png = load_image("brushes/0.png");
+    for(f = IMAGE_U8; f <= IMAGE_F16; ++f){
+        image n = load_image_format("brushes/0.png", f);
+        TEST(n.format == f && n.w == png.w && n.h == png.h && n.c == png.c);
+        TEST(max_diff(n, png) < 1e-3);
+        free_image(n);
+    }
+    free_image(png);
+}
+
+void test_separable()
+{
+    image row, col;
+    image g = make_gaussian_filter(3);
+    image box = make_box_filter(5);
+    image gx = make_gx_filter();
+    image hp = make_highpass_filter();
+    TEST(separate_filter(g, &row, &col));
+    TEST(row.w == g.w && col.h == g.h);
+    free_image(row);
+    free_image(col);
+    TEST(separate_filter(box, &row, &col));
+    free_image(row);
+    free_image(col);
+    TEST(separate_filter(gx, &row, &col));
+    TEST(within_eps(row.data[0]*col.data[1], -2));
+    free_image(row);
+    free_image(col);
+    TEST(!separate_filter(hp, &row, &col));
+
+    image g1 = make_1d_gaussian(3);
+    TEST(g1.w == g.w && g1.h == 1);
+    TEST(within_eps(g1.data[g1.w/2]*g1.data[g1.w/2], get_pixel(g, g.w/2, g.h/2, 0)));
+
+    image im = make_test_image(53, 37, 3, 8);
+    BORDER b;
+    for(b = BORDER_CLAMP; b <= BORDER_WRAP; ++b){
+        image r = convolve_reference(im, g, 1, b);
+        image s = convolve_separable_border(im, g1, g1, 1, b);
+        TEST(max_diff(r, s) < 1e-5);
+        image r0 = convolve_reference(im, g, 0, b);
+        image s0 = convolve_separable_border(im, g1, g1, 0, b);
+        TEST(max_diff(r0, s0) < 1e-5);
+        free_image(r);
+        free_image(s);
+        free_image(r0);
+        free_image(s0);
+    }
+    image sm = smooth_image(im, 3);
+    image r = convolve_reference(im, g, 1, BORDER_CLAMP);
+    TEST(max_diff(sm, r) < 1e-5);
+
+    // empty images filter to empty images
+    image empty = make_image(0, 0, 3);
+    image ef = convolve_image(empty, box, 1);
+    TEST(ef.w == 0 && ef.h == 0 && ef.c == 3);
+    free_image(ef);
+    free_image(empty);
+
+    // a padded column filter gives its taps, not its row padding
+    image gc = make_aligned_image(1, g1.w, 1);
+    int k;
+    for(k = 0; k < g1.w; ++k) set_pixel(gc, 0, k, 0, g1.data[k]);
+    TEST(gc.stride > gc.w);
+    image sa = convolve_separable(im, g1, gc, 1);
+    TEST(max_diff(sa, r) < 1e-5);
+    free_image(sa);
+    free_image(gc);
+
+    free_image(sm);
+    free_image(r);
+    free_image(im);
+    free_image(g1);
+    free_image(g);
+    free_image(box);
+    free_image(gx);
+    free_image(hp);
+}
+
+void test_iir_gaussian()
+{
+    // Blocks of flat color with hard edges, the worst case for the IIR tails.
+    // The recursive filter is good to about 2% per axis on a step.
+    image im = make_image(160, 120, 1);
+    int i, j;
+    for(j = 0; j < im.h; ++j){
+        for(i = 0; i < im.w; ++i){
+            set_pixel(im, i, j, 0, ((i/20 + j/30) % 2) ? 1 : 0);
+        }
+    }
+    TEST(iir_accuracy_report(im, 2) < .04);
+    TEST(iir_accuracy_report(im, 5) < .04);
+    TEST(iir_accuracy_report(im, 10) < .04);
+    image n = convert_image(im, IMAGE_U8);
+    image s = smooth_image_iir(n, 5);
+    TEST(s.format == IMAGE_U8);
+    free_image(n);
+    free_image(s);
+    free_image(im);
+}
+
+void test_box_filter()
+{
+    image im = make_test_image(67, 43, 2, 11);
+    int sizes[] = {1, 4, 7, 50};
+    int i;
+    BORDER b;
+    for(i = 0; i < 4; ++i){
+        image f = make_box_filter(sizes[i]);
+        for(b = BORDER_CLAMP; b <= BORDER_WRAP; ++b){
+            image r = convolve_reference(im, f, 1, b);
+            image s = box_blur_image(im, sizes[i], b);
+            TEST(max_diff(r, s) < 1e-5);
+            free_image(r);
+            free_image(s);
+        }
+        free_image(f);
+    }
+    // u8 sums are exact, the mean only rounds once
+    image n = convert_image(im, IMAGE_U8);
+    image nf = convert_image(n, IMAGE_F32);
+    image ones = make_image(5, 5, 1);
+    for(i = 0; i < 25; ++i) ones.data[i] = 1;
+    image r = convolve_reference(nf, ones, 1, BORDER_ZERO);
+    image s = box_sum_image(n, 5, BORDER_ZERO);
+    TEST(max_diff(r, s) < 1e-5);
+    image sf = box_filter_image(nf, 5);
+    TEST(max_diff(r, sf) < 1e-5);
+    image m = box_blur_image(n, 5, BORDER_ZERO);
+    TEST(m.format == IMAGE_U8);
+    scale_image(r, 0, 1/25.);
+    scale_image(r, 1, 1/25.);
+    TEST(max_diff(m, r) <= .5/255 + 1e-6);
+    free_image(m);
+    free_image(sf);
+    free_image(s);
+    free_image(r);
+    free_image(ones);
+    free_image(nf);
+    free_image(n);
+    free_image(im);
+
+    image blocks = make_image(160, 120, 1);
+    int x, y;
+    for(y = 0; y < blocks.h; ++y){
+        for(x = 0; x < blocks.w; ++x){
+            set_pixel(blocks, x, y, 0, ((x/20 + y/30) % 2) ? 1 : 0);
+        }
+    }
+    image g = smooth_image(blocks, 4);
+    image g3 = smooth_image_box(blocks, 4, 3);
+    image g5 = smooth_image_box(blocks, 4, 5);
+    TEST(max_diff(g, g3) < .05);
+    TEST(max_diff(g, g5) < max_diff(g, g3));
+    free_image(g);
+    free_image(g3);
+    free_image(g5);
+    free_image(blocks);
+}
+
+void test_fused_sobel()
+{
+    image im = make_test_image(45, 31, 3, 12);
+    image fgx = make_gx_filter();
+    image fgy = make_gy_filter();
+    image gx = convolve_image(im, fgx, 0);
+    image gy = convolve_image(im, fgy, 0);
+    image *res = sobel_image(im);
+    image *fast = sobel_image_fast(im);
+    float angle = 0, mag = 0;
+    int i;
+    for(i = 0; i < im.w*im.h; ++i){
+        float x = gx.data[i], y = gy.data[i];
+        mag = MAX(mag, fabsf(res[0].data[i] - sqrtf(x*x + y*y)));
+        angle = MAX(angle, fabsf(res[1].data[i] - atan2f(y, x)));
+    }
+    TEST(mag < 1e-4);
+    TEST(angle < 1e-4);
+    TEST(max_diff(res[0], fast[0]) < 1e-5);
+    TEST(max_diff(res[1], fast[1]) < 2e-5);
+
+    // colorize matches the unfused normalize and hsv_to_rgb steps
+    feature_normalize(res[0]);
+    feature_normalize(res[1]);
+    image hsv = make_image(im.w, im.h, 3);
+    for(i = 0; i < im.w*im.h; ++i){
+        hsv.data[i] = res[1].data[i];
+        hsv.data[i + im.w*im.h] = res[0].data[i];
+        hsv.data[i + 2*im.w*im.h] = res[0].data[i];
+    }
+    hsv_to_rgb(hsv);
+    image color = colorize_sobel(im);
+    TEST(max_diff(color, hsv) < 1e-5);
+    image n = convert_image(im, IMAGE_U8);
+    image cn = colorize_sobel_fast(n);
+    TEST(cn.w == im.w && cn.c == 3);
+
+    free_image(cn);
+    free_image(n);
+    free_image(color);
+    free_image(hsv);
+    for(i = 0; i < 2; ++i){
+        free_image(res[i]);
+        free_image(fast[i]);
+    }
+    free(res);
+    free(fast);
+    free_image(gx);
+    free_image(gy);
+    free_image(fgx);
+    free_image(fgy);
+    free_image(im);
+}
+
+void test_reduce()
+{
+    image im = make_test_image(83, 57, 3, 13);
+    set_pixel(im, 17, 40, 1, 2);
+    set_pixel(im, 60, 50, 2, 2);
+    set_pixel(im, 5, 3, 2, -1);
+    image_stats s = reduce_image(im, -1);
+    double sum = 0, sum2 = 0;
+    int i;
+    for(i = 0; i < im.w*im.h*im.c; ++i){
+        sum += im.data[i];
+        sum2 += im.data[i]*im.data[i];
+    }
+    TEST(s.n == (size_t)im.w*im.h*im.c);
+    TEST(s.min == -1 && s.max == 2);
+    TEST(s.argmax_x == 17 && s.argmax_y == 40 && s.argmax_c == 1);
+    TEST(fabs(s.sum - sum) < 1e-2 && fabs(s.sum2 - sum2) < 1e-2);
+    image_stats s2 = reduce_image(im, 2);
+    TEST(s2.argmax_x == 60 && s2.argmax_y == 50 && s2.argmax_c == 2);
+
+    set_image_threads(3);
+    image_stats t = reduce_image(im, -1);
+    set_image_threads(0);
+    TEST(t.sum == s.sum && t.sum2 == s.sum2);
+
+    feature_normalize(im);
+    s = reduce_image(im, -1);
+    TEST(within_eps(s.min, 0) && within_eps(s.max, 1));
+    l1_normalize(im);
+    for(i = 0; i < im.c; ++i){
+        TEST(within_eps(reduce_image(im, i).sum, 1));
+    }
+    image n = convert_image(im, IMAGE_U16);
+    feature_normalize(n);
+    s = reduce_image(n, -1);
+    TEST(s.min == 0 && s.max == 1);
+    free_image(n);
+    free_image(im);
+}
+
+void test_pyramid()
+{
+    image im = make_test_image(101, 64, 3, 14);
+    pyramid *p = make_pyramid(im, 0);
+    TEST(pyramid_levels(p) == 4);
+    image g2 = pyramid_level(p, 2);
+    TEST(g2.w == 26 && g2.h == 16 && g2.c == 3);
+    TEST(pyramid_level(p, 2).data == g2.data);
+
+    // one level is the 5x5 binomial blur sampled at even pixels
+    float k[5] = {1, 4, 6, 4, 1};
+    image f = make_image(5, 5, 1);
+    int i, j, c;
+    for(j = 0; j < 5; ++j){
+        for(i = 0; i < 5; ++i) set_pixel(f, i, j, 0, k[i]*k[j]/256);
+    }
+    image blur = convolve_reference(im, f, 1, BORDER_REFLECT);
+    image g1 = pyramid_level(p, 1);
+    float d = 0;
+    for(c = 0; c < im.c; ++c){
+        for(j = 0; j < g1.h; ++j){
+            for(i = 0; i < g1.w; ++i){
+                d = MAX(d, fabsf(get_pixel(g1, i, j, c) - get_pixel(blur, 2*i, 2*j, c)));
+            }
+        }
+    }
+    TEST(d < 1e-5);
+
+    image back = collapse_pyramid(p);
+    TEST(max_diff(back, im) < 1e-5);
+
+    pyramid *q = make_pyramid(im, 2);
+    TEST(pyramid_levels(q) == 2);
+    image flat = make_image(40, 30, 1);
+    for(i = 0; i < 40*30; ++i) flat.data[i] = .5;
+    image down = pyramid_down(flat);
+    image up = pyramid_up(down, 40, 30);
+    TEST(within_eps(get_pixel(up, 7, 29, 0), .5) && within_eps(get_pixel(up, 39, 0, 0), .5));
+
+    free_image(up);
+    free_image(down);
+    free_image(flat);
+    free_pyramid(q);
+    free_image(back);
+    free_image(blur);
+    free_image(f);
+    free_pyramid(p);
+    free_image(im);
+}
+
+void test_resample()
+{
+    image im = make_test_image(36, 22, 3, 15);
+    int x, y, c;
+
+    // bilinear_resize interpolates like bilinear_interpolate
+    image bl = bilinear_resize(im, 81, 50);
+    float d = 0;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < bl.h; ++y){
+            for(x = 0; x < bl.w; ++x){
+                float a = -0.5 + 1.0*im.w/bl.w*(x + 0.5);
+                float b = -0.5 + 1.0*im.h/bl.h*(y + 0.5);
+                // bilinear_interpolate is 0 on whole coordinates
+                if(a == floorf(a) || b == floorf(b)) continue;
+                d = MAX(d, fabsf(get_pixel(bl, x, y, c) - bilinear_interpolate(im, a, b, c)));
+            }
+        }
+    }
+    TEST(d < 1e-5);
+    image nn = nn_resize(im, 72, 44);
+    TEST(within_eps(get_pixel(nn, 9, 13, 2), get_pixel(im, 4, 6, 2)));
+
+    // area shrinking by 2 is the mean of each 2x2 block
+    image area = resize_image(im, 18, 11, RESIZE_AREA);
+    TEST(within_eps(get_pixel(area, 3, 4, 1), (get_pixel(im, 6, 8, 1) + get_pixel(im, 7, 8, 1)
+                    + get_pixel(im, 6, 9, 1) + get_pixel(im, 7, 9, 1))/4));
+
+    // every filter keeps flat images flat and ramps straight
+    image ramp = make_image(40, 30, 1);
+    for(y = 0; y < ramp.h; ++y){
+        for(x = 0; x < ramp.w; ++x) set_pixel(ramp, x, y, 0, .5 + .01*x);
+    }
+    RESIZE_FILTER f;
+    for(f = RESIZE_BILINEAR; f <= RESIZE_AREA; ++f){
+        image up = resize_image(ramp, 80, 60, f);
+        image down = resize_image(ramp, 13, 7, f);
+        TEST(within_eps(get_pixel(down, 6, 3, 0), .5 + .01*19.5));
+        if(f != RESIZE_AREA) TEST(within_eps(get_pixel(up, 41, 5, 0), .5 + .01*(41*.5 - .25)));
+        free_image(up);
+        free_image(down);
+    }
+    // no rows or columns out gives an empty image
+    image e0 = resize_image(im, 5, 0, RESIZE_BICUBIC);
+    image e1 = nn_resize(im, 0, 7);
+    image e2 = bilinear_resize(im, 9, 0);
+    TEST(e0.w == 5 && e0.h == 0 && e1.w == 0 && e1.h == 7 && e2.h == 0);
+    int ey0, ey1;
+    resample_rows_needed(im.h, 10, RESIZE_LANCZOS3, 1, 4, 4, &ey0, &ey1);
+    TEST(ey0 == 0 && ey1 == 0);
+    free_image(e0);
+    free_image(e1);
+    free_image(e2);
+
+    // area at a ratio that isn't whole covers partly covered pixels too
+    image impulse = make_image(5, 1, 1);
+    set_pixel(impulse, 2, 0, 0, 1);
+    image box = resize_image(impulse, 2, 1, RESIZE_AREA);
+    TEST(within_eps(get_pixel(box, 0, 0, 0), .2) && within_eps(get_pixel(box, 1, 0, 0), .2));
+    image shrunk = resize_image(im, 10, 7, RESIZE_AREA);
+    for(c = 0; c < im.c; ++c){
+        image_stats a = reduce_image(im, c), b = reduce_image(shrunk, c);
+        TEST(fabsf(a.sum/(im.w*im.h) - b.sum/(shrunk.w*shrunk.h)) < 1e-5);
+    }
+    free_image(shrunk);
+    free_image(box);
+    free_image(impulse);
+
+    image n = convert_image(im, IMAGE_U8);
+    image nr = resize_image(n, 50, 30, RESIZE_LANCZOS3);
+    TEST(nr.format == IMAGE_U8 && nr.w == 50 && nr.h == 30);
+
+    free_image(nr);
+    free_image(n);
+    free_image(ramp);
+    free_image(area);
+    free_image(nn);
+    free_image(bl);
+    free_image(im);
+}
+
+void test_downscale()
+{
+    image im = make_test_image(50, 29, 3, 16);
+    int f;
+    for(f = 1; f <= 5; ++f){
+        image d = downscale_image(im, f, 0);
+        image ref = resize_image(im, im.w/f, im.h/f, RESIZE_AREA);
+        TEST(d.w == im.w/f && d.h == im.h/f);
+        // RESIZE_AREA spreads the dropped edge over the whole row, so
+        // only compare when the blocks tile the image
+        if(im.w % f == 0 && im.h % f == 0) TEST(max_diff(d, ref) < 1e-5);
+        if(f == 2) TEST(within_eps(get_pixel(d, 3, 2, 1), (get_pixel(im, 6, 4, 1) + get_pixel(im, 7, 4, 1)
+                        + get_pixel(im, 6, 5, 1) + get_pixel(im, 7, 5, 1))/4));
+        free_image(ref);
+        free_image(d);
+    }
+    image g = downscale_image(im, 2, 1);
+    image gray = rgb_to_grayscale(im);
+    image g2 = downscale_image(gray, 2, 0);
+    TEST(g.c == 1 && max_diff(g, g2) < 1e-5);
+
+    image n = convert_image(im, IMAGE_U8);
+    image nd = downscale_image(n, 3, 0);
+    image fd = downscale_image(im, 3, 0);
+    image nf = convert_image(nd, IMAGE_F32);
+    TEST(nd.format == IMAGE_U8 && max_diff(nf, fd) < 1/255. + 1e-3);
+    image ng = downscale_image(n, 4, 1);
+    TEST(ng.format == IMAGE_U8 && ng.c == 1 && ng.w == 12);
+
+    free_image(ng);
+    free_image(nf);
+    free_image(fd);
+    free_image(nd);
+    free_image(n);
+    free_image(g2);
+    free_image(gray);
+    free_image(g);
+    free_image(im);
+}
+
+void test_load_images()
+{
+    char names[7][64];
+    char *paths[7];
+    int i;
+    for(i = 0; i < 7; ++i){
+        image im = make_test_image(5 + i, 4, 3, 19 + i);
+        sprintf(names[i], "/tmp/uwimg_load_%d", i);
+        save_png(im, names[i]);
+        strcat(names[i], ".png");
+        paths[i] = names[i];
+        free_image(im);
+    }
+    // more files than slots in flight, come back in order
+    set_image_threads(3);
+    image *ims = load_images(paths, 7);
+    set_image_threads(0);
+    int ordered = 1;
+    for(i = 0; i < 7; ++i){
+        image ref = load_image(paths[i]);
+        ordered &= ims[i].w == 5 + i && same_image(ims[i], ref);
+        free_image(ref);
+        free_image(ims[i]);
+        remove(paths[i]);
+    }
+    TEST(ordered);
+    free(ims);
+}
+
+void test_encode()
+{
+    // two deflate chunks, clamped values
+    image im = make_test_image(700, 520, 3, 20);
+    set_pixel(im, 3, 4, 0, 1.7);
+    set_pixel(im, 5, 4, 1, -.3);
+    set_image_threads(3);
+    save_png(im, "/tmp/uwimg_encode");
+    set_image_threads(0);
+    image png = load_image("/tmp/uwimg_encode.png");
+    set_pixel(im, 3, 4, 0, 1);
+    set_pixel(im, 5, 4, 1, 0);
+    TEST(png.w == im.w && png.h == im.h && max_diff(png, im) < .5/255 + 1e-6);
+
+    // restart-joined strips decode like the image coded in one go
+    save_image_quality(im, "/tmp/uwimg_encode", 90);
+    image jpg = load_image("/tmp/uwimg_encode.jpg");
+    image n = convert_image(im, IMAGE_U8);
+    unsigned char *whole = malloc((size_t)im.w*im.h*3);
+    int x, y, c;
+    for(y = 0; y < im.h; ++y) for(x = 0; x < im.w; ++x) for(c = 0; c < 3; ++c){
+        whole[(y*im.w + x)*3 + c] = IMAGE_ROW8(n, y, c)[x];
+    }
+    stbi_write_jpg("/tmp/uwimg_whole.jpg", im.w, im.h, 3, whole, 90);
+    image ref = load_image("/tmp/uwimg_whole.jpg");
+    TEST(same_image(jpg, ref) && max_diff(jpg, ref) == 0);
+    remove("/tmp/uwimg_encode.png");
+    remove("/tmp/uwimg_encode.jpg");
+    remove("/tmp/uwimg_whole.jpg");
+
+    free(whole);
+    free_image(ref);
+    free_image(n);
+    free_image(jpg);
+    free_image(png);
+    free_image(im);
+}
+
+void test_decode()
+{
+    // rgba with every byte value, alpha dropped without a fourth plane
+    int w = 67, h = 5, x, y, c;
+    unsigned char *rgba = malloc((size_t)w*h*4);
+    for(x = 0; x < w*h*4; ++x) rgba[x] = (x*37 + x/7) & 255;
+    stbi_write_png("/tmp/uwimg_decode.png", w, h, 4, rgba, w*4);
+    image im = load_image("/tmp/uwimg_decode.png");
+    int ok = im.c == 3 && im.w == w && im.h == h;
+    for(y = 0; ok && y < h; ++y) for(x = 0; x < w; ++x) for(c = 0; c < 3; ++c){
+        ok = ok && get_pixel(im, x, y, c) == (float)(rgba[(y*w + x)*4 + c]/255.);
+    }
+    TEST(ok);
+    image b = load_image_format("/tmp/uwimg_decode.png", IMAGE_U8);
+    ok = b.c == 3;
+    for(y = 0; ok && y < h; ++y) for(x = 0; x < w; ++x) for(c = 0; c < 3; ++c){
+        ok = ok && IMAGE_ROW8(b, y, c)[x] == rgba[(y*w + x)*4 + c];
+    }
+    TEST(ok);
+    image ref = load_image_format("/tmp/uwimg_decode.png", IMAGE_F16);
+    TEST(ref.c == 3 && max_diff(im, ref) < 1e-3);
+    stbi_write_png("/tmp/uwimg_decode.png", w, h, 1, rgba, w);
+    image g = load_image("/tmp/uwimg_decode.png");
+    ok = g.c == 1;
+    for(x = 0; ok && x < w*h; ++x) ok = get_pixel(g, x%w, x/w, 0) == (float)(rgba[x]/255.);
+    TEST(ok);
+    remove("/tmp/uwimg_decode.png");
+    free(rgba);
+    free_image(ref);
+    free_image(g);
+    free_image(b);
+    free_image(im);
+}
+
+void test_memory_image()
+{
+    image im = make_test_image(40, 30, 3, 22);
+    int n;
+    unsigned char *png = encode_image_to_memory(im, "png", 0, &n);
+    image a = load_image_from_memory(png, n);
+    TEST(a.w == 40 && a.h == 30 && a.c == 3 && max_diff(a, im) < .5/255 + 1e-6);
+
+    // the same bytes save_image_quality writes
+    unsigned char *jpg = encode_image_to_memory(im, "jpg", 80, &n);
+    save_image_quality(im, "/tmp/uwimg_memory", 80);
+    FILE *fp = fopen("/tmp/uwimg_memory.jpg", "rb");
+    unsigned char *file = malloc(n + 1);
+    int got = fread(file, 1, n + 1, fp);
+    fclose(fp);
+    TEST(got == n && !memcmp(file, jpg, n));
+    image b = load_image_from_memory(jpg, n);
+    image ref = load_image("/tmp/uwimg_memory.jpg");
+    TEST(same_image(b, ref) && max_diff(b, ref) == 0);
+    remove("/tmp/uwimg_memory.jpg");
+
+    image bad = load_image_from_memory(png, 20);
+    TEST(!bad.data && !encode_image_to_memory(im, "gif", 0, &n));
+    image none = make_image(40, 0, 3);
+    TEST(!encode_image_to_memory(none, "png", 0, &n) && n == 0);
+    TEST(!encode_image_to_memory(none, "jpg", 90, &n) && n == 0);
+    remove("/tmp/uwimg_empty.png");
+    save_png(none, "/tmp/uwimg_empty");
+    TEST(!fopen("/tmp/uwimg_empty.png", "rb"));
+    free_image(none);
+    free(file);
+    free_encoded_image(jpg);
+    free_encoded_image(png);
+    free_image(ref);
+    free_image(b);
+    free_image(a);
+    free_image(im);
+}
+
+static void batch_draw(int i, void *ctx)
+{
+    int *out = ctx;
+    thread_srand(i);
+    out[2*i] = thread_rand();
+    out[2*i + 1] = get_image_threads() == 1 && get_worker_threads() == 1;
+}
+
+void test_batch()
+{
+    // seeded sequences are per thread, whichever thread runs each call
+    int n = 37, i, ok = 1;
+    int *out = calloc(2*n, sizeof(int));
+    set_image_threads(4);
+    run_batch(n, batch_draw, out);
+    set_image_threads(0);
+    for(i = 0; i < n; ++i){
+        thread_srand(i);
+        ok = ok && out[2*i] == thread_rand() && out[2*i + 1];
+    }
+    TEST(ok);
+    thread_srand(5);
+    int a = thread_rand(), b = thread_rand();
+    thread_srand(5);
+    TEST(a == thread_rand() && b == thread_rand() && a != b && a >= 0);
+    free(out);
+}
+
+void test_binary_image()
+{
+    const char *fname = "/tmp/uwimg_binary.bin";
+    image im = make_test_image(23, 17, 3, 18);
+    save_image_binary(im, fname);
+    image l = load_image_binary(fname);
+    TEST(l.format == IMAGE_F32 && same_image(l, im));
+    image m = map_image_binary(fname, IMAGE_MAP_VERIFY);
+    TEST(same_image(m, im) && (size_t)m.data % IMAGE_ALIGN == 0);
+    TEST(unmap_image(m) == 1);
+    TEST(unmap_image(l) == 0);
+
+    // format and aligned layout come back as saved
+    image n = convert_image(im, IMAGE_U8);
+    image a = align_image(n);
+    save_image_binary(a, fname);
+    m = map_image_binary(fname, IMAGE_MAP_WRITE);
+    TEST(m.format == IMAGE_U8 && m.stride == a.stride && m.cstride == a.cstride);
+    TEST((size_t)IMAGE_ROW8(m, 5, 2) % IMAGE_ALIGN == 0);
+    TEST(within_eps(format_get(m, 7, 5, 2), format_get(n, 7, 5, 2)));
+    // copy-on-write leaves the file alone
+    IMAGE_ROW8(m, 0, 0)[0] = 255 - IMAGE_ROW8(n, 0, 0)[0];
+    free_image(m);
+    image b = load_image_binary(fname);
+    TEST(b.data && IMAGE_ROW8(b, 0, 0)[0] == IMAGE_ROW8(n, 0, 0)[0]);
+
+    // a flipped payload byte fails the checksum
+    FILE *fp = fopen(fname, "r+b");
+    fseek(fp, 64, SEEK_SET);
+    fputc(255 - IMAGE_ROW8(a, 0, 0)[0], fp);
+    fclose(fp);
+    m = map_image_binary(fname, IMAGE_MAP_VERIFY);
+    TEST(m.data == 0);
+
+    // files from before the header
+    fp = fopen(fname, "wb");
+    fwrite(&im.w, sizeof(int), 1, fp);
+    fwrite(&im.h, sizeof(int), 1, fp);
+    fwrite(&im.c, sizeof(int), 1, fp);
+    fwrite(im.data, sizeof(float), im.w*im.h*im.c, fp);
+    fclose(fp);
+    image old = load_image_binary(fname);
+    TEST(old.format == IMAGE_F32 && same_image(old, im));
+
+    // headers that don't describe their payload are refused
+    int i, refused = 1;
+    for(i = 0; i < 6; ++i){
+        save_image_binary(im, fname);
+        image_header h;
+        fp = fopen(fname, "r+b");
+        TEST(read_image_header(fp, &h));
+        if(i == 0) h.version = 99;
+        if(i == 1) h.w = h.h = 4000;
+        if(i == 2) h.format = 9;
+        if(i == 3) h.stride = h.w - 1;
+        if(i == 4) h.bytes += 4;
+        if(i == 5) h.cstride = -h.cstride;
+        fseek(fp, 0, SEEK_SET);
+        fwrite(&h, sizeof(h), 1, fp);
+        fclose(fp);
+        image bad = map_image_binary(fname, 0);
+        image badl = load_image_binary(fname);
+        refused = refused && !bad.data && !badl.data;
+    }
+    TEST(refused);
+    remove(fname);
+
+    free_image(old);
+    free_image(b);
+    free_image(a);
+    free_image(n);
+    free_image(l);
+    free_image(im);
+}
+
+static void stream_negate(image strip, void *ctx)
+{
+    shift_scale_image(strip, -1, -*(float *)ctx, -1);
+}
+
+void test_stream()
+{
+    image im = make_test_image(61, 47, 3, 17);
+
+    // smooth then resize, strips of 7 rows against the whole frame
+    image_stream *st = make_image_stream(image_source_from_image(im));
+    stream_smooth(st, 1.5);
+    stream_resize(st, 40, 29, RESIZE_BICUBIC);
+    int w, h, c;
+    stream_shape(st, &w, &h, &c, 0);
+    TEST(w == 40 && h == 29 && c == 3);
+    image out = make_image(w, h, c);
+    run_image_stream(st, image_sink_to_image(out), 7);
+    image s = smooth_image(im, 1.5);
+    image ref = resize_image(s, 40, 29, RESIZE_BICUBIC);
+    TEST(max_diff(out, ref) < 1e-5);
+    free_image(ref);
+    free_image(s);
+    free_image(out);
+
+    // gray, 2d filter and a point op
+    image f = make_gaussian_filter(2);
+    float one = 1;
+    st = make_image_stream(image_source_from_image(im));
+    stream_grayscale(st);
+    stream_convolve(st, f, 1);
+    stream_map(st, stream_negate, &one);
+    out = make_image(im.w, im.h, 1);
+    run_image_stream(st, image_sink_to_image(out), 5);
+    image g = rgb_to_grayscale(im);
+    ref = convolve_image(g, f, 1);
+    shift_scale_image(ref, -1, -1, -1);
+    TEST(max_diff(out, ref) < 1e-5);
+    free_image(ref);
+    free_image(g);
+    free_image(out);
+
+    // a u8 stream summed over channels turns float for the next stage
+    image n = convert_image(im, IMAGE_U8);
+    st = make_image_stream(image_source_from_image(n));
+    stream_convolve(st, f, 0);
+    stream_resize(st, 30, 20, RESIZE_BILINEAR);
+    IMAGE_FORMAT fmt;
+    stream_shape(st, &w, &h, &c, &fmt);
+    TEST(c == 1 && fmt == IMAGE_F32);
+    out = make_image(30, 20, 1);
+    run_image_stream(st, image_sink_to_image(out), 6);
+    g = convolve_image(n, f, 0);
+    ref = resize_image(g, 30, 20, RESIZE_BILINEAR);
+    TEST(max_diff(out, ref) < 1e-5);
+    free_image(ref);
+    free_image(g);
+    free_image(out);
+    free_image(n);
+    free_image(f);
+
+    // files: binary in, PPM out and back
+    save_image_binary(im, "/tmp/uwimg_stream.bin");
+    st = make_image_stream(open_binary_source("/tmp/uwimg_stream.bin"));
+    run_image_stream(st, open_pnm_sink("/tmp/uwimg_stream.ppm", im.w, im.h, im.c), 8);
+    image_source src = open_pnm_source("/tmp/uwimg_stream.ppm");
+    TEST(src.w == im.w && src.h == im.h && src.c == 3 && src.format == IMAGE_U8);
+    st = make_image_stream(src);
+    out = make_image(im.w, im.h, im.c);
+    run_image_stream(st, image_sink_to_image(out), 16);
+    TEST(max_diff(out, im) < .5/255 + 1e-6);
+    remove("/tmp/uwimg_stream.bin");
+    remove("/tmp/uwimg_stream.ppm");
+
+    free_image(out);
+    free_image(im);
+}
+
+void test_fft_convolve()
+{
+    // A 15 x 11 filter that doesn't separate, on an image a few tiles wide.
+    image f = make_test_image(15, 11, 1, 5);
+    image f3 = make_test_image(9, 9, 3, 6);
+    image im = make_test_image(300, 170, 3, 7);
+    BORDER b;
+    for(b = BORDER_CLAMP; b <= BORDER_WRAP; ++b){
+        image r = convolve_reference(im, f, 1, b);
+        image s = convolve_fft_border(im, f, 1, b);
+        TEST(max_diff(r, s) < 1e-3);
+        image r0 = convolve_reference(im, f3, 0, b);
+        image s0 = convolve_fft_border(im, f3, 0, b);
+        TEST(max_diff(r0, s0) < 1e-3);
+        free_image(r);
+        free_image(s);
+        free_image(r0);
+        free_image(s0);
+    }
+    image big = make_test_image(25, 25, 1, 8);
+    TEST(use_fft_convolve(im, big, 1));
+    image d = convolve_image(im, big, 1);
+    image r = convolve_reference(im, big, 1, BORDER_CLAMP);
+    TEST(max_diff(d, r) < 1e-2);
+    image n = convert_image(im, IMAGE_U8);
+    image s = convolve_fft(n, f3, 1);
+    TEST(s.format == IMAGE_U8 && s.c == 3);
+
+    image hp = make_highpass_filter();
+    TEST(!use_fft_convolve(im, hp, 1));
+
+    // images thinner than the filter
+    image f8 = make_test_image(8, 8, 1, 9);
+    image tall = make_test_image(1, 40, 3, 10);
+    image wide = make_test_image(40, 1, 3, 11);
+    image tr = convolve_reference(tall, f8, 1, BORDER_REFLECT);
+    image ts = convolve_fft_border(tall, f8, 1, BORDER_REFLECT);
+    image td = convolve_image(tall, f8, 1);
+    image tc = convolve_reference(tall, f8, 1, BORDER_CLAMP);
+    TEST(max_diff(tr, ts) < 1e-3 && max_diff(tc, td) < 1e-3);
+    image wr = convolve_reference(wide, f8, 0, BORDER_WRAP);
+    image ws = convolve_fft_border(wide, f8, 0, BORDER_WRAP);
+    TEST(max_diff(wr, ws) < 1e-3);
+    free_image(f8);
+    free_image(tall);
+    free_image(wide);
+    free_image(tr);
+    free_image(ts);
+    free_image(td);
+    free_image(tc);
+    free_image(wr);
+    free_image(ws);
+
+    clear_fft_cache();
+    free_image(hp);
+    free_image(big);
+    free_image(n);
+    free_image(s);
+    free_image(d);
+    free_image(r);
+    free_image(f);
+    free_image(f3);
+    free_image(im);
+}
+
+void test_threads()
+{
+    // Every path has to give the same bits on any thread count,
+    // including the preserve = 0 channel sums.
+    image im = make_test_image(211, 97, 3, 9);
+    image f[3];
+    f[0] = make_emboss_filter();
+    f[1] = make_gaussian_filter(2);
+    f[2] = make_test_image(25, 25, 1, 10);
+    int i, p;
+    for(i = 0; i < 3; ++i){
+        for(p = 0; p < 2; ++p){
+            set_image_threads(1);
+            image a = convolve_image(im, f[i], p);
+            set_image_threads(4);
+            image b = convolve_image(im, f[i], p);
+            TEST(max_diff(a, b) == 0);
+            free_image(a);
+            free_image(b);
+        }
+        free_image(f[i]);
+    }
+    set_image_threads(0);
+    TEST(get_image_threads() >= 1);
+    free_image(im);
+}
+
 void test_projection()
 {
     matrix H = make_translation_homography(12.4, -3.2);
@@ -597,7 +1766,7 @@ void test_layer()
 
 void make_matrix_test()
 {
-    srand(1);
+    thread_srand(1);
     matrix a = random_matrix(32, 64, 10);
     matrix w = random_matrix(64, 16, 10);
     matrix y = random_matrix(32, 64, 10);
@@ -719,6 +1888,34 @@ void test_hw5()
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
+void test_core()
+{
+    test_aligned_image();
+    test_border();
+    test_image_pool();
+    test_color_simd();
+    test_fused_hybrid();
+    test_formats();
+    test_separable();
+    test_iir_gaussian();
+    test_box_filter();
+    test_reduce();
+    test_pyramid();
+    test_resample();
+    test_downscale();
+    test_stream();
+    test_binary_image();
+    test_load_images();
+    test_encode();
+    test_decode();
+    test_memory_image();
+    test_batch();
+    test_fft_convolve();
+    test_fused_sobel();
+    test_threads();
+    printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
+}
+
 void run_tests()
 {
     test_structure();
@@ -15,4 +15,5 @@ void test_hw2();
 void test_hw3();
 void test_hw4();
 void test_hw5();
+void test_core();
 #endif
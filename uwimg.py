@@ -14,7 +14,10 @@ class IMAGE(Structure):
     _fields_ = [("w", c_int),
                 ("h", c_int),
                 ("c", c_int),
-                ("data", POINTER(c_float))]
+                ("data", POINTER(c_float)),
+                ("stride", c_int),
+                ("cstride", c_int),
+                ("format", c_int)]
     def __add__(self, other):
         return add_image(self, other)
     def __sub__(self, other):
@@ -53,6 +56,9 @@ class MODEL(Structure):
 
 
 (LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX) = range(5)
+(IMAGE_F32, IMAGE_U8, IMAGE_U16, IMAGE_F16) = range(4)
+FORMAT_TYPES = {IMAGE_F32: ('<f4', 4), IMAGE_U8: ('|u1', 1),
+                IMAGE_U16: ('<u2', 2), IMAGE_F16: ('<f2', 2)}
 
 
 add_image = lib.add_image
@@ -63,12 +69,97 @@ sub_image = lib.sub_image
 sub_image.argtypes = [IMAGE, IMAGE]
 sub_image.restype = IMAGE
 
+hybrid_image = lib.hybrid_image
+hybrid_image.argtypes = [IMAGE, IMAGE, IMAGE, c_float]
+hybrid_image.restype = IMAGE
+
+shift_scale_clamp_image = lib.shift_scale_clamp_image
+shift_scale_clamp_image.argtypes = [IMAGE, c_float, c_float]
+shift_scale_clamp_image.restype = None
+
 make_image = lib.make_image
 make_image.argtypes = [c_int, c_int, c_int]
 make_image.restype = IMAGE
 
-free_image = lib.free_image
-free_image.argtypes = [IMAGE]
+make_aligned_image = lib.make_aligned_image
+make_aligned_image.argtypes = [c_int, c_int, c_int]
+make_aligned_image.restype = IMAGE
+
+align_image = lib.align_image
+align_image.argtypes = [IMAGE]
+align_image.restype = IMAGE
+
+pack_image = lib.pack_image
+pack_image.argtypes = [IMAGE]
+pack_image.restype = IMAGE
+
+free_image_lib = lib.free_image
+free_image_lib.argtypes = [IMAGE]
+free_image_lib.restype = None
+
+def free_image(im):
+    # images over numpy arrays belong to the array
+    if getattr(im, '_owner', None) is None:
+        free_image_lib(im)
+
+class IMAGE_VIEW(object):
+    # __array_interface__ for an image. IMAGE itself can't carry one, as
+    # numpy tries the ctypes buffer of the struct first and gives up.
+    def __init__(self, im):
+        self.im = im
+        typestr, size = FORMAT_TYPES[im.format]
+        self.__array_interface__ = {
+            'version': 3,
+            'shape': (im.c, im.h, im.w),
+            'typestr': typestr,
+            'data': (cast(im.data, c_void_p).value or 0, False),
+            'strides': (im.cstride*size, im.stride*size, size)}
+
+def image_to_numpy(im):
+    # A (c, h, w) numpy view of the pixels, no copy. Writes go to the image,
+    # and the view is only good until the image is freed.
+    import numpy as np
+    return np.asarray(IMAGE_VIEW(im))
+
+def image_from_numpy(a):
+    # Wrap a (c, h, w) or (h, w) float32, uint8, uint16 or float16 array as
+    # an image without copying. Rows have to be contiguous. The image keeps
+    # the array alive and free_image leaves it alone.
+    import numpy as np
+    a = np.asarray(a)
+    if a.ndim == 2:
+        a = np.lib.stride_tricks.as_strided(a, (1,) + a.shape, (a.strides[0]*a.shape[0],) + a.strides)
+    fmt = {np.dtype('<f4'): IMAGE_F32, np.dtype('u1'): IMAGE_U8,
+           np.dtype('<u2'): IMAGE_U16, np.dtype('<f2'): IMAGE_F16}.get(a.dtype)
+    if fmt is None or a.ndim != 3:
+        raise TypeError("need a (c, h, w) or (h, w) float32, uint8, uint16 or float16 array")
+    size = a.itemsize
+    if a.strides[2] != size or any(s <= 0 or s % size for s in a.strides[:2]) or not a.flags.aligned:
+        raise ValueError("rows must be contiguous, see numpy.ascontiguousarray")
+    im = IMAGE(a.shape[2], a.shape[1], a.shape[0], cast(a.ctypes.data, POINTER(c_float)),
+               a.strides[1]//size, a.strides[0]//size, fmt)
+    im._owner = a
+    return im
+
+clear_image_pool = lib.clear_image_pool
+clear_image_pool.argtypes = []
+clear_image_pool.restype = None
+
+set_image_pool_limit = lib.set_image_pool_limit
+set_image_pool_limit.argtypes = [c_size_t]
+set_image_pool_limit.restype = None
+
+print_image_pool_stats = lib.print_image_pool_stats
+print_image_pool_stats.argtypes = []
+print_image_pool_stats.restype = None
+
+set_image_threads = lib.set_image_threads
+set_image_threads.argtypes = [c_int]
+set_image_threads.restype = None
+
+get_image_threads = lib.get_image_threads
+get_image_threads.argtypes = []
+get_image_threads.restype = c_int
 
 get_pixel = lib.get_pixel
 get_pixel.argtypes = [IMAGE, c_int, c_int, c_int]
@@ -117,6 +208,17 @@ load_image_lib.restype = IMAGE
 def load_image(f):
     return load_image_lib(f.encode('ascii'))
 
+load_image_format_lib = lib.load_image_format
+load_image_format_lib.argtypes = [c_char_p, c_int]
+load_image_format_lib.restype = IMAGE
+
+def load_image_format(f, fmt):
+    return load_image_format_lib(f.encode('ascii'), fmt)
+
+convert_image = lib.convert_image
+convert_image.argtypes = [IMAGE, c_int]
+convert_image.restype = IMAGE
+
 save_png_lib = lib.save_png
 save_png_lib.argtypes = [IMAGE, c_char_p]
 save_png_lib.restype = None
@@ -131,6 +233,34 @@ save_image_lib.restype = None
 def save_image(im, f):
     return save_image_lib(im, f.encode('ascii'))
 
+load_image_from_memory_lib = lib.load_image_from_memory
+load_image_from_memory_lib.argtypes = [c_char_p, c_int]
+load_image_from_memory_lib.restype = IMAGE
+
+def load_image_from_memory(b):
+    im = load_image_from_memory_lib(bytes(b), len(b))
+    if not im.data:
+        raise ValueError("couldn't decode image")
+    return im
+
+encode_image_to_memory_lib = lib.encode_image_to_memory
+encode_image_to_memory_lib.argtypes = [IMAGE, c_char_p, c_int, POINTER(c_int)]
+encode_image_to_memory_lib.restype = c_void_p
+
+free_encoded_image = lib.free_encoded_image
+free_encoded_image.argtypes = [c_void_p]
+free_encoded_image.restype = None
+
+def encode_image_to_memory(im, ext="png", quality=100):
+    n = c_int()
+    p = encode_image_to_memory_lib(im, ext.encode('ascii'), quality, byref(n))
+    if not p:
+        raise ValueError("couldn't encode image as " + ext)
+    try:
+        return string_at(p, n.value)
+    finally:
+        free_encoded_image(p)
+
 same_image = lib.same_image
 same_image.argtypes = [IMAGE, IMAGE]
 same_image.restype = c_int
@@ -143,6 +273,16 @@ bilinear_resize = lib.bilinear_resize
 bilinear_resize.argtypes = [IMAGE, c_int, c_int]
 bilinear_resize.restype = IMAGE
 
+RESIZE_NEAREST, RESIZE_BILINEAR, RESIZE_BICUBIC, RESIZE_LANCZOS3, RESIZE_AREA = range(5)
+
+resize_image = lib.resize_image
+resize_image.argtypes = [IMAGE, c_int, c_int, c_int]
+resize_image.restype = IMAGE
+
+downscale_image = lib.downscale_image
+downscale_image.argtypes = [IMAGE, c_int, c_int]
+downscale_image.restype = IMAGE
+
 make_sharpen_filter = lib.make_sharpen_filter
 make_sharpen_filter.argtypes = []
 make_sharpen_filter.restype = IMAGE
@@ -175,14 +315,38 @@ colorize_sobel = lib.colorize_sobel
 colorize_sobel.argtypes = [IMAGE]
 colorize_sobel.restype = IMAGE
 
+sobel_image_fast = lib.sobel_image_fast
+sobel_image_fast.argtypes = [IMAGE]
+sobel_image_fast.restype = POINTER(IMAGE)
+
+colorize_sobel_fast = lib.colorize_sobel_fast
+colorize_sobel_fast.argtypes = [IMAGE]
+colorize_sobel_fast.restype = IMAGE
+
 make_gaussian_filter = lib.make_gaussian_filter
 make_gaussian_filter.argtypes = [c_float]
 make_gaussian_filter.restype = IMAGE
 
+smooth_image = lib.smooth_image
+smooth_image.argtypes = [IMAGE, c_float]
+smooth_image.restype = IMAGE
+
+smooth_image_iir = lib.smooth_image_iir
+smooth_image_iir.argtypes = [IMAGE, c_float]
+smooth_image_iir.restype = IMAGE
+
+smooth_image_box = lib.smooth_image_box
+smooth_image_box.argtypes = [IMAGE, c_float, c_int]
+smooth_image_box.restype = IMAGE
+
 convolve_image = lib.convolve_image
 convolve_image.argtypes = [IMAGE, IMAGE, c_int]
 convolve_image.restype = IMAGE
 
+convolve_fft = lib.convolve_fft
+convolve_fft.argtypes = [IMAGE, IMAGE, c_int]
+convolve_fft.restype = IMAGE
+
 harris_corner_detector = lib.harris_corner_detector
 harris_corner_detector.argtypes = [IMAGE, c_float, c_float, c_int, POINTER(c_int)]
 harris_corner_detector.restype = POINTER(DESCRIPTOR)
@@ -257,11 +421,42 @@ demo_alpha.restype = IMAGE
 def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
     return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
 
+# Batches run in C on a thread each, one call for the whole list. Like
+# every binding here (CDLL, not PyDLL) the GIL is released for the call,
+# so other Python threads keep running too.
+panorama_images_lib = lib.panorama_images
+panorama_images_lib.argtypes = [POINTER(IMAGE), POINTER(IMAGE), c_int, c_float, c_float, c_int, c_float, c_int, c_int, POINTER(IMAGE)]
+panorama_images_lib.restype = None
+
+def panorama_images(pairs, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
+    n = len(pairs)
+    out = (IMAGE*n)()
+    panorama_images_lib(c_array(IMAGE, [p[0] for p in pairs]), c_array(IMAGE, [p[1] for p in pairs]), n,
+                        sigma, thresh, nms, inlier_thresh, iters, cutoff, out)
+    return list(out)
+
+apply_brushes_batch_lib = lib.apply_brushes_batch
+apply_brushes_batch_lib.argtypes = [POINTER(IMAGE), POINTER(c_int), c_int, POINTER(IMAGE)]
+apply_brushes_batch_lib.restype = None
+
+def apply_brushes_batch(ims, resize_indexes):
+    n = len(ims)
+    out = (IMAGE*n)()
+    apply_brushes_batch_lib(c_array(IMAGE, ims), c_array(c_int, resize_indexes), n, out)
+    return list(out)
+
 
 train_model = lib.train_model
 train_model.argtypes = [MODEL, DATA, c_int, c_int, c_double, c_double, c_double]
 train_model.restype = None
 
+train_models_lib = lib.train_models
+train_models_lib.argtypes = [POINTER(MODEL), POINTER(DATA), c_int, c_int, c_int, c_double, c_double, c_double]
+train_models_lib.restype = None
+
+def train_models(models, datas, batch, iters, rate, momentum, decay):
+    train_models_lib(c_array(MODEL, models), c_array(DATA, datas), len(models), batch, iters, rate, momentum, decay)
+
 accuracy_model = lib.accuracy_model
 accuracy_model.argtypes = [MODEL, DATA]
 accuracy_model.restype = c_double